@@ -0,0 +1,114 @@
+#!/bin/bash
+# Boot Pure64 under QEMU with each core count and memory size and report the
+# time taken by each boot stage, one CSV row per stage, in microseconds.
+#
+# ./bench.sh [bios] [uefi]
+#
+# BENCH_SMP, BENCH_MEM (MiB), BENCH_RUNS, BENCH_TIMEOUT (seconds), QEMU, and
+# OVMF (UEFI firmware image) override the defaults below. BENCH_PROFILE is the
+# build.sh profile to measure.
+
+SMP=${BENCH_SMP:-"1 2 4 8"}
+MEM=${BENCH_MEM:-"256 1024 4096"}
+RUNS=${BENCH_RUNS:-3}
+TIMEOUT=${BENCH_TIMEOUT:-60}
+QEMU=${QEMU:-qemu-system-x86_64}
+OVMF=${OVMF:-/usr/share/OVMF/OVMF_CODE.fd}
+PROFILE=${BENCH_PROFILE:-default}
+FIRMWARE=${*:-bios uefi}
+
+ACCEL="-accel tcg"
+if [ -w /dev/kvm ]; then
+	ACCEL="-accel kvm -cpu host"
+fi
+
+./build.sh $PROFILE || exit 1
+
+mkdir -p bin/bench/efi/EFI/BOOT
+cd src/bench
+nasm timing.asm -o ../../bin/bench/timing.sys || exit 1
+cd ../..
+
+cat bin/pure64.sys bin/bench/timing.sys > bin/bench/software.sys
+
+# BIOS disk image, as in docs/README.md
+dd if=/dev/zero of=bin/bench/disk.img count=8 bs=1048576 > /dev/null 2>&1
+dd if=bin/mbr.sys of=bin/bench/disk.img conv=notrunc > /dev/null 2>&1
+dd if=bin/bench/software.sys of=bin/bench/disk.img bs=512 seek=16 conv=notrunc > /dev/null 2>&1
+
+# UEFI boot directory, given to QEMU as a FAT drive
+cp bin/uefi.sys bin/bench/efi/EFI/BOOT/BOOTX64.EFI
+dd if=bin/bench/software.sys of=bin/bench/efi/EFI/BOOT/BOOTX64.EFI bs=4096 seek=1 conv=notrunc > /dev/null 2>&1
+
+REPORT=bin/bench/report.csv
+FAILED=0
+echo "firmware,smp,memory,run,stage,us" > $REPORT
+
+for fw in $FIRMWARE; do
+	case $fw in
+	bios)
+		DRIVE="-drive format=raw,file=bin/bench/disk.img"
+		;;
+	uefi)
+		if [ ! -r "$OVMF" ]; then
+			echo "bench: $OVMF not found, set OVMF to the UEFI firmware image" >&2
+			FAILED=1
+			continue
+		fi
+		DRIVE="-drive if=pflash,format=raw,readonly=on,file=$OVMF -drive format=raw,file=fat:bin/bench/efi"
+		;;
+	*)
+		echo "bench: unknown firmware $fw" >&2
+		FAILED=1
+		continue
+		;;
+	esac
+	for smp in $SMP; do
+		for mem in $MEM; do
+			for run in $(seq 1 $RUNS); do
+				LOG=bin/bench/$fw-$smp-$mem-$run.log
+				timeout $TIMEOUT $QEMU -machine q35 $ACCEL -smp $smp -m $mem $DRIVE \
+					-display none -monitor none -serial file:$LOG -no-reboot \
+					-device isa-debug-exit,iobase=0xf4,iosize=0x04 > /dev/null 2>&1
+				# The timing payload lists raw TSC values, see src/bench/timing.asm
+				awk -v fw=$fw -v smp=$smp -v mem=$mem -v run=$run '
+				function stage(name, a, b,	us) {
+					if (v[a] == 0 || v[b] == 0)
+						return
+					us = (v[b] - v[a]) * 1000000 / v["tsc_hz"]
+					if (us < 0)
+						us = 0		# AP TSCs are read before they are synchronized
+					printf "%s,%s,%s,%s,%s,%.1f\n", fw, smp, mem, run, name, us
+				}
+				$1 == "pure64-timing" { v[$2] = $3 + 0 }
+				END {
+					if (!("end" in v) || v["tsc_hz"] == 0)
+						exit 1
+					stage("e820", "e820", "read")
+					stage("read", "read", "start")
+					stage("load", "load", "load_end")
+					stage("vbe", "vbe", "paging")
+					stage("paging", "paging", "paging_end")
+					stage("payload", "payload", "payload_end")
+					stage("acpi", "acpi", "acpi_end")
+					stage("cpu", "cpu", "cpu_end")
+					stage("pic", "pic", "pic_end")
+					stage("smp", "smp", "smp_end")
+					stage("last_ap", "smp", "last_ap")
+					stage("handoff", "jump", "entry")
+					stage("pure64", "start", "jump")
+					stage("total", "e820", "entry")
+					if (v["e820"] == 0)
+						stage("total", "start", "entry")
+				}' $LOG >> $REPORT
+				if [ $? -ne 0 ]; then
+					echo "bench: no timing from $fw with -smp $smp -m $mem, see $LOG" >&2
+					FAILED=1
+				fi
+			done
+		done
+	done
+done
+
+cat $REPORT
+exit $FAILED
@@ -1,17 +1,62 @@
 #!/bin/bash
+# ./build.sh [profile] [nasm options]
+#
+# A profile leaves subsystems out of Pure64 and the loaders when they are
+# assembled. The nasm options are added after it, e.g. -DBOOT_TIMING or any of
+# NO_SMP, NO_VIDEO, NO_SERIAL, NO_LEGACY_IRQ, NO_SCRUB, NO_PCI, and NO_X2APIC.
+#
+# default - everything, chosen at boot with the cfg_ bytes in sysvar.asm
+# server  - headless compute nodes: no video, no PIC or RTC interrupts
+# display - appliances: no x2APIC, no PCIe enumeration, no memory scrub
+#
+# Pure64 is padded to 16 KiB in every profile, or to a -DPURE64SIZE given
+# here. The loaders are given that size as PURE64SIZE.
+#
+# UEFI_PAYLOAD names the payload that will follow pure64.sys in uefi.sys. The
+# EFI image is then sized to hold it, e.g. UEFI_PAYLOAD=kernel.bin ./build.sh
+
+PROFILE=${1:-default}
+[ $# -gt 0 ] && shift
+
+case $PROFILE in
+default)
+	DEFINES=""
+	;;
+server)
+	DEFINES="-DNO_VIDEO -DNO_LEGACY_IRQ"
+	;;
+display)
+	DEFINES="-DNO_X2APIC -DNO_PCI -DNO_SCRUB"
+	;;
+*)
+	echo "build: unknown profile $PROFILE" >&2
+	exit 1
+	;;
+esac
+DEFINES="$DEFINES $*"
+
+UEFI_DEFINES=""
+if [ -n "$UEFI_PAYLOAD" ]; then
+	if [ ! -r "$UEFI_PAYLOAD" ]; then
+		echo "build: can not read $UEFI_PAYLOAD" >&2
+		exit 1
+	fi
+	UEFI_DEFINES="-DUEFI_PAYLOAD_SIZE=$(( $(wc -c < "$UEFI_PAYLOAD") ))"
+fi
 
 mkdir -p bin
 
 cd src
 
-nasm pure64.asm -o ../bin/pure64.sys -l ../bin/pure64-debug.txt
+nasm $DEFINES pure64.asm -o ../bin/pure64.sys -l ../bin/pure64-debug.txt || exit 1
+DEFINES="$DEFINES -DPURE64SIZE=$(( $(wc -c < ../bin/pure64.sys) ))"
 
 cd boot
 
-nasm mbr.asm -o ../../bin/mbr.sys
-nasm pxestart.asm -o ../../bin/pxestart.sys
-nasm multiboot.asm -o ../../bin/multiboot.sys
-nasm multiboot2.asm -o ../../bin/multiboot2.sys
-nasm uefi.asm -o ../../bin/uefi.sys
+nasm $DEFINES mbr.asm -o ../../bin/mbr.sys || exit 1
+nasm $DEFINES pxestart.asm -o ../../bin/pxestart.sys || exit 1
+nasm $DEFINES multiboot.asm -o ../../bin/multiboot.sys || exit 1
+nasm $DEFINES multiboot2.asm -o ../../bin/multiboot2.sys || exit 1
+nasm $DEFINES $UEFI_DEFINES uefi.asm -o ../../bin/uefi.sys || exit 1
 
 cd ../..
@@ -1,3 +1,4 @@
 #!/bin/sh
 
 rm -f bin/*.sys
+rm -rf bin/bench
@@ -0,0 +1,183 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; Boot timing payload for bench.sh. The boot timing table is sent to the serial
+; port as "pure64-timing <name> <value>" lines and QEMU is then stopped with
+; the isa-debug-exit device. Values are raw TSC counts in decimal
+; =============================================================================
+
+
+BITS 64
+ORG 0x0000000000100000
+
+start:
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov r15, rax			; R15 = TSC when the payload started
+	cld
+
+	mov esi, timing_entries
+timing_next:
+	movzx ebx, byte [rsi]
+	inc esi
+	cmp bl, 0xFF
+	je timing_extra
+	mov rax, [IM_TIMING+rbx]
+	call print_entry
+	jmp timing_next
+
+timing_extra:				; RSI points to the names of the extra values
+	mov rax, r15
+	call print_entry		; entry
+	mov rax, [p_TSCFrequency]
+	call print_entry		; tsc_hz
+	movzx eax, word [p_cpu_activated]
+	call print_entry		; cpus
+	xor eax, eax			; Find the last AP to arrive
+	xor ecx, ecx
+timing_ap_next:
+	cmp cx, [p_cpu_detected]
+	jae timing_ap_done
+	cmp rax, [IM_CPU_ARRIVAL+rcx*8]
+	cmovb rax, [IM_CPU_ARRIVAL+rcx*8]
+	inc ecx
+	jmp timing_ap_next
+timing_ap_done:
+	call print_entry		; last_ap
+	mov esi, msg_end
+	call print_string
+
+	mov dx, 0xF4			; isa-debug-exit, QEMU exits with status 33
+	mov al, 0x10
+	out dx, al
+halt:
+	cli
+	hlt
+	jmp halt
+
+
+; -----------------------------------------------------------------------------
+; print_entry -- Send a "pure64-timing <name> <value>" line
+;  IN:	RSI = Name, 0 terminated
+;	RAX = Value
+; OUT:	RSI = Address after the name
+;	RAX, RBX, RCX, RDX are modified
+print_entry:
+	mov rbx, rax
+	push rsi
+	mov esi, msg_prefix
+	call print_string
+	pop rsi
+	call print_string
+	mov al, ' '
+	call print_char
+	mov rax, rbx
+	mov ebx, 10			; Push the decimal digits, lowest first
+	xor ecx, ecx
+print_entry_digit:
+	xor edx, edx
+	div rbx
+	push rdx
+	inc ecx
+	test rax, rax
+	jnz print_entry_digit
+print_entry_digit_out:
+	pop rax
+	add al, '0'
+	call print_char
+	dec ecx
+	jnz print_entry_digit_out
+	mov al, 10
+	jmp print_char
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; print_string -- Send a 0 terminated string to the serial port
+;  IN:	RSI = String
+; OUT:	RSI = Address after the string
+;	RAX, RDX are modified
+print_string:
+	lodsb
+	test al, al
+	jz print_string_done
+	call print_char
+	jmp print_string
+print_string_done:
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; print_char -- Send a character to the serial port
+;  IN:	AL = Character
+; OUT:	RDX is modified
+print_char:
+	push rax
+	mov dx, 0x03F8 + 5		; Line Status Register
+print_char_wait:
+	in al, dx
+	test al, 0x20
+	jz print_char_wait
+	pop rax
+	mov dx, 0x03F8
+	out dx, al
+	ret
+; -----------------------------------------------------------------------------
+
+
+msg_prefix: db 'pure64-timing ', 0
+msg_end: db 'pure64-timing end', 10, 0
+
+timing_entries:				; Offset in IM_TIMING and name
+db TIMING_E820, 'e820', 0
+db TIMING_VBE, 'vbe', 0
+db TIMING_READ, 'read', 0
+db TIMING_START, 'start', 0
+db TIMING_LOAD, 'load', 0
+db TIMING_LOAD+8, 'load_end', 0
+db TIMING_PAGING, 'paging', 0
+db TIMING_PAGING+8, 'paging_end', 0
+db TIMING_PAYLOAD, 'payload', 0
+db TIMING_PAYLOAD+8, 'payload_end', 0
+db TIMING_ACPI, 'acpi', 0
+db TIMING_ACPI+8, 'acpi_end', 0
+db TIMING_CPU, 'cpu', 0
+db TIMING_CPU+8, 'cpu_end', 0
+db TIMING_PIC, 'pic', 0
+db TIMING_PIC+8, 'pic_end', 0
+db TIMING_SMP, 'smp', 0
+db TIMING_SMP+8, 'smp_end', 0
+db TIMING_JUMP, 'jump', 0
+db 0xFF
+db 'entry', 0
+db 'tsc_hz', 0
+db 'cpus', 0
+db 'last_ap', 0
+
+
+; Addresses and offsets read from Pure64. Must match sysvar.asm
+IM_TIMING:		equ 0x0000000000005200		; 8 bytes per entry, see TIMING_*
+IM_CPU_ARRIVAL:		equ 0x000000000001D000		; 8 bytes per entry, same order as IM_CPU_APICID
+p_TSCFrequency:		equ 0x0000000000005800 + 0x30	; in Hz
+p_cpu_activated:	equ 0x0000000000005800 + 0x102
+p_cpu_detected:		equ 0x0000000000005800 + 0x104
+
+TIMING_E820:		equ 0x00
+TIMING_VBE:		equ 0x08
+TIMING_READ:		equ 0x10
+TIMING_START:		equ 0x18
+TIMING_LOAD:		equ 0x20
+TIMING_PAGING:		equ 0x30
+TIMING_ACPI:		equ 0x40
+TIMING_CPU:		equ 0x50
+TIMING_PIC:		equ 0x60
+TIMING_SMP:		equ 0x70
+TIMING_PAYLOAD:		equ 0x80
+TIMING_JUMP:		equ 0x90
+
+
+; =============================================================================
+; EOF
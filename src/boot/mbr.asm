@@ -3,7 +3,8 @@
 ; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
 ;
 ; This Master Boot Record will load Pure64 from a pre-defined location on the
-; hard drive without making use of the file system.
+; hard drive without making use of the file system. Pure64 reads the rest of
+; a larger payload itself with the DAP and drive number left in memory here.
 ;
 ; In this code we are expecting a BMFS-formatted drive. With BMFS the Pure64
 ; binary is required to start at sector 16 (8192 bytes from the start). A small
@@ -43,6 +44,9 @@ entry:
 ; inputs: es:di -> destination buffer for 24 byte entries
 ; outputs: bp = entry count, trashes all registers except esi
 do_e820:
+	rdtsc				; Stage timestamps are left on the stack for Pure64
+	push edx
+	push eax
 	mov edi, 0x00006000		; location that memory map will be stored to
 	xor ebx, ebx			; ebx must be 0 to start
 	xor bp, bp			; keep an entry count in bp
@@ -107,32 +111,10 @@ check_A20:
 	mov si, msg_Load
 	call print_string_16
 
-	mov cx, 0x4000 - 1		; Start looking from here
-VBESearch:
-	inc cx
-	cmp cx, 0x5000
-	je halt
-	mov edi, VBEModeInfoBlock	; VBE data will be stored at this address
-	mov ax, 0x4F01			; GET SuperVGA MODE INFORMATION - http://www.ctyme.com/intr/rb-0274.htm
-
-	mov bx, cx			; Mode is saved to BX for the set command later
-	int 0x10
-	cmp ax, 0x004F			; Return value in AX should equal 0x004F if command supported and successful
-	jne VBESearch			; Try next mode
-	cmp byte [VBEModeInfoBlock.BitsPerPixel], 32 ; Desired bit depth
-	jne VBESearch			; If not equal, try next mode
-	cmp word [VBEModeInfoBlock.XResolution], 800 ; Desired XRes here
-	jne VBESearch
-	cmp word [VBEModeInfoBlock.YResolution], 600 ; Desired YRes here
-	jne VBESearch
-
-	or bx, 0x4000			; Use linear/flat frame buffer model (set bit 14)
-	mov ax, 0x4F02			; SET SuperVGA VIDEO MODE - http://www.ctyme.com/intr/rb-0275.htm
-	int 0x10
-	cmp ax, 0x004F			; Return value in AX should equal 0x004F if supported and successful
-	jne halt
-
 	; Read the 2nd stage boot loader into memory.
+	rdtsc				; Start of the read
+	push edx
+	push eax
 	mov ah, 0x42			; Extended Read
 	mov dl, [DriveNumber]		; http://www.ctyme.com/intr/rb-0708.htm
 	mov si, DAP
@@ -143,6 +125,7 @@ VBESearch:
 	mov ax, [0x8006]
 	cmp ax, 0x3436			; Match against the Pure64 binary
 	jne sig_fail
+	mov byte [0x8005], 'B'		; Let Pure64 know it can read the rest of the payload from here
 
 	mov si, msg_OK
 	call print_string_16
@@ -186,12 +169,11 @@ print_string_16:			; Output string in SI to screen
 	ret
 ;------------------------------------------------------------------------------
 
-align 16
 GDTR32:					; Global Descriptors Table Register
 dw gdt32_end - gdt32 - 1		; limit of GDT (size minus one)
-dq gdt32				; linear address of GDT
+dd gdt32				; linear address of GDT
 
-align 16
+align 8
 gdt32:
 dw 0x0000, 0x0000, 0x0000, 0x0000	; Null descriptor
 dw 0xFFFF, 0x0000, 0x9A00, 0x00CF	; 32-bit code descriptor
@@ -225,43 +207,4 @@ times 510-$+$$ db 0
 
 sign dw 0xAA55
 
-VBEModeInfoBlock: equ 0x5F00
-; VESA
-; Mandatory information for all VBE revisions
-VBEModeInfoBlock.ModeAttributes		equ VBEModeInfoBlock + 0	; DW - mode attributes
-VBEModeInfoBlock.WinAAttributes		equ VBEModeInfoBlock + 2	; DB - window A attributes
-VBEModeInfoBlock.WinBAttributes		equ VBEModeInfoBlock + 3	; DB - window B attributes
-VBEModeInfoBlock.WinGranularity		equ VBEModeInfoBlock + 4	; DW - window granularity in KB
-VBEModeInfoBlock.WinSize		equ VBEModeInfoBlock + 6	; DW - window size in KB
-VBEModeInfoBlock.WinASegment		equ VBEModeInfoBlock + 8	; DW - window A start segment
-VBEModeInfoBlock.WinBSegment		equ VBEModeInfoBlock + 10	; DW - window B start segment
-VBEModeInfoBlock.WinFuncPtr		equ VBEModeInfoBlock + 12	; DD - real mode pointer to window function
-VBEModeInfoBlock.BytesPerScanLine	equ VBEModeInfoBlock + 16	; DW - bytes per scan line
-; Mandatory information for VBE 1.2 and above
-VBEModeInfoBlock.XResolution		equ VBEModeInfoBlock + 18	; DW - horizontal resolution in pixels or characters
-VBEModeInfoBlock.YResolution		equ VBEModeInfoBlock + 20	; DW - vertical resolution in pixels or characters
-VBEModeInfoBlock.XCharSize		equ VBEModeInfoBlock + 22	; DB - character cell width in pixels
-VBEModeInfoBlock.YCharSize		equ VBEModeInfoBlock + 23	; DB - character cell height in pixels
-VBEModeInfoBlock.NumberOfPlanes		equ VBEModeInfoBlock + 24	; DB - number of memory planes
-VBEModeInfoBlock.BitsPerPixel		equ VBEModeInfoBlock + 25	; DB - bits per pixel
-VBEModeInfoBlock.NumberOfBanks		equ VBEModeInfoBlock + 26	; DB - number of banks
-VBEModeInfoBlock.MemoryModel		equ VBEModeInfoBlock + 27	; DB - memory model type
-VBEModeInfoBlock.BankSize		equ VBEModeInfoBlock + 28	; DB - bank size in KB
-VBEModeInfoBlock.NumberOfImagePages	equ VBEModeInfoBlock + 29	; DB - number of image pages
-VBEModeInfoBlock.Reserved		equ VBEModeInfoBlock + 30	; DB - reserved (0x00 for VBE 1.0-2.0, 0x01 for VBE 3.0)
-; Direct Color fields (required for direct/6 and YUV/7 memory models)
-VBEModeInfoBlock.RedMaskSize		equ VBEModeInfoBlock + 31	; DB - size of direct color red mask in bits
-VBEModeInfoBlock.RedFieldPosition	equ VBEModeInfoBlock + 32	; DB - bit position of lsb of red mask
-VBEModeInfoBlock.GreenMaskSize		equ VBEModeInfoBlock + 33	; DB - size of direct color green mask in bits
-VBEModeInfoBlock.GreenFieldPosition	equ VBEModeInfoBlock + 34	; DB - bit position of lsb of green mask
-VBEModeInfoBlock.BlueMaskSize		equ VBEModeInfoBlock + 35	; DB - size of direct color blue mask in bits
-VBEModeInfoBlock.BlueFieldPosition	equ VBEModeInfoBlock + 36	; DB - bit position of lsb of blue mask
-VBEModeInfoBlock.RsvdMaskSize		equ VBEModeInfoBlock + 37	; DB - size of direct color reserved mask in bits
-VBEModeInfoBlock.RsvdFieldPosition	equ VBEModeInfoBlock + 38	; DB - bit position of lsb of reserved mask
-VBEModeInfoBlock.DirectColorModeInfo	equ VBEModeInfoBlock + 39	; DB - direct color mode attributes
-; Mandatory information for VBE 2.0 and above
-VBEModeInfoBlock.PhysBasePtr		equ VBEModeInfoBlock + 40	; DD - physical address for flat memory frame buffer
-VBEModeInfoBlock.Reserved1		equ VBEModeInfoBlock + 44	; DD - Reserved - always set to 0
-VBEModeInfoBlock.Reserved2		equ VBEModeInfoBlock + 48	; DD - Reserved - always set to 0
-
 ; EOF
@@ -31,6 +31,11 @@ MAGIC			equ 0x1BADB002
 FLAGS			equ FLAG_ALIGN | FLAG_MEMINFO | FLAG_VIDEO | FLAG_AOUT_KLUDGE
 CHECKSUM		equ -(MAGIC + FLAGS)
 
+%ifndef PURE64SIZE
+%error "PURE64SIZE must be set to the size of pure64.sys, see build.sh"
+%endif
+PAYLOAD_MAGIC		equ 'PL64'	; Payload header, see sysvar.asm
+
 mode_type		equ 0	; Linear
 width			equ 1024
 height			equ 768
@@ -96,8 +101,18 @@ memmap_end:
 	mov esi, multiboot_end
 	mov edi, 0x00008000
 	mov ecx, 8192		; Copy 32K
+	cmp dword [multiboot_end+PURE64SIZE], PAYLOAD_MAGIC
+	jne copy_loader
+	mov ecx, (PURE64SIZE+28) / 4
+	rep movsd		; Copy Pure64 and the header up to the Source field
+	lea eax, [esi+4]
+	stosd			; Source, the payload is left where GRUB put it
+	jmp start_pure64
+copy_loader:
 	rep movsd		; Copy loader to expected address
 
+start_pure64:
+
 	cli
 
 	jmp 0x00008000
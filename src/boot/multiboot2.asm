@@ -18,6 +18,14 @@ ARCHITECHTURE		equ 0
 HEADER_LENGTH		equ multiboot_header_end - multiboot_header_start
 CHECKSUM		equ 0x100000000 - (MAGIC + ARCHITECHTURE + HEADER_LENGTH)
 
+%ifndef PURE64SIZE
+%error "PURE64SIZE must be set to the size of pure64.sys, see build.sh"
+%endif
+PAYLOAD_MAGIC		equ 'PL64'	; Payload header, see sysvar.asm
+VBEModeInfoBlock	equ 0x5F00	; Must match sysvar.asm
+LOADER_RSDP		equ 0x5FC0	; Must match sysvar.asm
+E820_END		equ 0x7800	; End of the room for the memory map from 0x6000
+
 _start:				; We need some code before the multiboot header
 	xor eax, eax		; Clear eax and ebx in the event
 	xor ebx, ebx		; we are not loaded by GRUB.
@@ -29,6 +37,16 @@ multiboot_header_start:
 	dd ARCHITECHTURE
 	dd HEADER_LENGTH
 	dd CHECKSUM
+address_tag_start:		; Load the whole file as a flat binary
+	dw 2
+	dw 0
+	dd address_tag_end - address_tag_start
+	dd multiboot_header_start
+	dd _start
+	dd 0			; Load to the end of the file
+	dd 0			; No bss
+address_tag_end:
+	align 8
 entry_address_tag_start:
 	dw 3
 	dw 0
@@ -43,6 +61,7 @@ framebuffer_tag_start:
         dd 600
         dd 32
 framebuffer_tag_end:
+	align 8			; Each tag must be 64-bit aligned
 	dw 0			; End type
 	dw 0
 	dd 8
@@ -51,5 +70,190 @@ multiboot_header_end:
 multiboot_entry:
 	cmp eax, 0x36D76289	; Magic value
 	jne error
+	mov esp, 0x8000
+	push 0
+	popf
+	cld			; Clear direction flag
+
+; Clear the VBE data, the RSDP copy, and the memory map
+	mov edi, VBEModeInfoBlock
+	xor eax, eax
+	mov ecx, 64
+	rep stosd
+	mov ecx, 8
+	rep stosd		; Blank record at 0x6000 in case there is no memory map tag
+
+; Walk the tags of the Multiboot2 information structure at EBX
+	lea esi, [ebx+8]	; The first tag follows the total size and reserved fields
+next_tag:
+	mov eax, [esi]		; Type
+	cmp eax, 0		; End tag
+	je tags_done
+	cmp eax, 3		; Module
+	je tag_module
+	cmp eax, 6		; Memory map
+	je tag_mmap
+	cmp eax, 8		; Framebuffer info
+	je tag_framebuffer
+	cmp eax, 14		; ACPI old RSDP
+	je tag_rsdp
+	cmp eax, 15		; ACPI new RSDP
+	je tag_rsdp
+skip_tag:
+	mov eax, [esi+4]	; Size
+	add eax, 7		; Tags are 64-bit aligned
+	and eax, -8
+	add esi, eax
+	jmp next_tag
+
+tag_module:
+	cmp dword [module_start], 0
+	jne skip_tag		; Only the first module is used
+	mov eax, [esi+8]
+	mov [module_start], eax
+	mov eax, [esi+12]
+	mov [module_end], eax
+	jmp skip_tag
+
+tag_mmap:			; Store it in the 32-byte E820 format used by the BIOS loaders
+	push esi
+	mov ecx, [esi+4]
+	add ecx, esi		; ECX = end of the tag
+	mov edx, [esi+8]	; EDX = size of each entry
+	add esi, 16
+	mov edi, 0x6000
+mmap_entry:
+	cmp esi, ecx
+	jae mmap_end
+	cmp edi, E820_END - 32
+	jae mmap_end		; Keep room for the blank record
+	push esi
+	movsd			; base_addr_low
+	movsd			; base_addr_high
+	movsd			; length_low
+	movsd			; length_high
+	movsd			; type, the values match E820
+	pop esi
+	mov eax, 1		; ACPI 3.X attributes, entry is valid
+	stosd
+	xor eax, eax		; padding
+	stosd
+	stosd
+	add esi, edx
+	jmp mmap_entry
+mmap_end:
+	xor eax, eax		; Create a blank record for termination (32 bytes)
+	mov ecx, 8
+	rep stosd
+	pop esi
+	jmp skip_tag
+
+tag_framebuffer:
+	cmp byte [esi+29], 1	; Direct RGB colour
+	jne skip_tag
+	mov eax, [esi+8]	; framebuffer_addr
+	mov [VBEModeInfoBlock+40], eax	; PhysBasePtr
+	mov eax, [esi+16]	; framebuffer_pitch
+	mov [VBEModeInfoBlock+16], ax	; BytesPerScanLine
+	mov eax, [esi+20]	; framebuffer_width
+	mov [VBEModeInfoBlock+18], ax	; XResolution
+	mov eax, [esi+24]	; framebuffer_height
+	mov [VBEModeInfoBlock+20], ax	; YResolution
+	mov al, [esi+28]	; framebuffer_bpp
+	mov [VBEModeInfoBlock+25], al	; BitsPerPixel
+	jmp skip_tag
+
+tag_rsdp:			; Keep a copy so Pure64 does not have to scan for it
+	cmp eax, 15
+	je tag_rsdp_copy	; The ACPI 2.0 copy is preferred
+	cmp dword [LOADER_RSDP], 0
+	jne skip_tag
+tag_rsdp_copy:
+	push esi
+	mov ecx, [esi+4]
+	sub ecx, 8		; Size of the RSDP
+	cmp ecx, 64
+	jbe tag_rsdp_size
+	mov ecx, 64
+tag_rsdp_size:
+	add esi, 8
+	mov edi, LOADER_RSDP
+	rep movsb
+	pop esi
+	jmp skip_tag
+
+tags_done:
+; Copy Pure64 to its expected location
+	mov esi, multiboot_end
+	mov edi, 0x00008000
+	mov ecx, PURE64SIZE / 4
+	rep movsd		; ESI and EDI now point to the payload header
+
+; The payload is the first module, or is appended to Pure64 in this file.
+; It is left where GRUB put it and Pure64 moves it only if it has to.
+	mov eax, [module_start]
+	test eax, eax
+	jz payload_file
+	mov esi, eax
+	cmp dword [esi], PAYLOAD_MAGIC
+	je payload_header
+	mov ecx, [module_end]	; A module without a header is run at 1MiB
+	sub ecx, eax
+	mov eax, PAYLOAD_MAGIC
+	stosd			; Magic
+	xor eax, eax
+	stosd			; Flags
+	mov eax, ecx
+	stosd			; Size
+	mov eax, 0x00100000
+	stosd			; Load Address
+	stosd			; Entry Point
+	xor eax, eax
+	stosd			; Uncompressed Size
+	stosd			; Checksum
+	mov eax, esi
+	stosd			; Source
+	jmp start_pure64
+
+payload_file:
+	cmp dword [esi], PAYLOAD_MAGIC
+	je payload_header
+	mov ecx, (32768 - PURE64SIZE) / 4
+	rep movsd		; Copy the legacy payload after Pure64
+	jmp start_pure64
+
+payload_header:
+	mov ecx, 7
+	rep movsd		; Copy the header up to the Source field
+	lea eax, [esi+4]
+	stosd			; Source, the payload data follows the header
+
+start_pure64:
+	mov byte [0x8005], 'M'	; Let Pure64 know it was booted via Multiboot2
+	cli
+	lgdt [GDTR32]		; The GDT left by GRUB may not be valid anymore
+	jmp 8:0x8000		; Enter Pure64 with a known 32-bit code segment
+
 error:
 	jmp $
+
+module_start:	dd 0
+module_end:	dd 0
+
+GDTR32:				; Global Descriptors Table Register
+dw gdt32_end - gdt32 - 1	; limit of GDT (size minus one)
+dd gdt32			; linear address of GDT
+
+align 8
+gdt32:
+dw 0x0000, 0x0000, 0x0000, 0x0000	; Null descriptor
+dw 0xFFFF, 0x0000, 0x9A00, 0x00CF	; 32-bit code descriptor
+dw 0xFFFF, 0x0000, 0x9200, 0x00CF	; 32-bit data descriptor
+gdt32_end:
+
+times 1024-$+$$ db 0		; Padding
+
+multiboot_end:
+
+; =============================================================================
+; EOF
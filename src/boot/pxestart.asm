@@ -9,11 +9,12 @@
 ;
 ; Max size of the resulting pxeboot.bin is 33792 bytes. 1K for the PXE loader
 ; stub and up to 32KiB for the code/data. PXE loads the file to address
-; 0x00007C00 (Just like a boot sector).
+; 0x00007C00 (Just like a boot sector). A payload with a header can be larger
+; as long as the whole file fits in free memory below 640KiB.
 ;
 ; File Sizes
 ; pxestart.bin	 1024 bytes
-; pure64.sys	 4096 bytes
+; pure64.sys	16384 bytes
 ; kernel64.sys	16384 bytes (or so)
 ; =============================================================================
 
@@ -105,30 +106,10 @@ check_A20:
 	mov si, msg_Load		; Print message
 	call print_string_16
 
-	mov edi, VBEModeInfoBlock	; VBE data will be stored at this address
-	mov ax, 0x4F01			; GET SuperVGA MODE INFORMATION - http://www.ctyme.com/intr/rb-0274.htm
-	; CX queries the mode, it should be in the form 0x41XX as bit 14 is set for LFB and bit 8 is set for VESA mode
-	; 0x4112 is 640x480x24bit, 0x4129 should be 32bit
-	; 0x4115 is 800x600x24bit, 0x412E should be 32bit
-	; 0x4118 is 1024x768x24bit, 0x4138 should be 32bit
-	; 0x411B is 1280x1024x24bit, 0x413D should be 32bit
-	mov cx, 0x4118			; Put your desired mode here
-	mov bx, cx			; Mode is saved to BX for the set command later
-	int 0x10
-
-	cmp ax, 0x004F			; Return value in AX should equal 0x004F if command supported and successful
-	jne halt
-	cmp byte [VBEModeInfoBlock.BitsPerPixel], 24	; Make sure this matches the number of bits for the mode!
-	jne halt			; If set bit mode was unsuccessful then bail out
-	or bx, 0x4000			; Use linear/flat frame buffer model (set bit 14)
-	mov ax, 0x4F02			; SET SuperVGA VIDEO MODE - http://www.ctyme.com/intr/rb-0275.htm
-	int 0x10
-	cmp ax, 0x004F			; Return value in AX should equal 0x004F if supported and successful
-	jne halt
-
 	mov ax, [0x8006]
 	cmp ax, 0x3436			; Match against the Pure64 binary
 	jne sig_fail
+	mov byte [0x8005], 'P'		; Let Pure64 know it can set the video mode via the BIOS
 
 	mov si, msg_OK
 	call print_string_16
@@ -191,43 +172,4 @@ sign dw 0xAA55				; BIOS boot sector signature
 
 times 1024-$+$$ db 0			; Padding so that Pure64 will be aligned at 0x8000
 
-VBEModeInfoBlock: equ 0x5F00
-; VESA
-; Mandatory information for all VBE revisions
-VBEModeInfoBlock.ModeAttributes		equ VBEModeInfoBlock + 0	; DW - mode attributes
-VBEModeInfoBlock.WinAAttributes		equ VBEModeInfoBlock + 2	; DB - window A attributes
-VBEModeInfoBlock.WinBAttributes		equ VBEModeInfoBlock + 3	; DB - window B attributes
-VBEModeInfoBlock.WinGranularity		equ VBEModeInfoBlock + 4	; DW - window granularity in KB
-VBEModeInfoBlock.WinSize		equ VBEModeInfoBlock + 6	; DW - window size in KB
-VBEModeInfoBlock.WinASegment		equ VBEModeInfoBlock + 8	; DW - window A start segment
-VBEModeInfoBlock.WinBSegment		equ VBEModeInfoBlock + 10	; DW - window B start segment
-VBEModeInfoBlock.WinFuncPtr		equ VBEModeInfoBlock + 12	; DD - real mode pointer to window function
-VBEModeInfoBlock.BytesPerScanLine	equ VBEModeInfoBlock + 16	; DW - bytes per scan line
-; Mandatory information for VBE 1.2 and above
-VBEModeInfoBlock.XResolution		equ VBEModeInfoBlock + 18	; DW - horizontal resolution in pixels or characters
-VBEModeInfoBlock.YResolution		equ VBEModeInfoBlock + 20	; DW - vertical resolution in pixels or characters
-VBEModeInfoBlock.XCharSize		equ VBEModeInfoBlock + 22	; DB - character cell width in pixels
-VBEModeInfoBlock.YCharSize		equ VBEModeInfoBlock + 23	; DB - character cell height in pixels
-VBEModeInfoBlock.NumberOfPlanes		equ VBEModeInfoBlock + 24	; DB - number of memory planes
-VBEModeInfoBlock.BitsPerPixel		equ VBEModeInfoBlock + 25	; DB - bits per pixel
-VBEModeInfoBlock.NumberOfBanks		equ VBEModeInfoBlock + 26	; DB - number of banks
-VBEModeInfoBlock.MemoryModel		equ VBEModeInfoBlock + 27	; DB - memory model type
-VBEModeInfoBlock.BankSize		equ VBEModeInfoBlock + 28	; DB - bank size in KB
-VBEModeInfoBlock.NumberOfImagePages	equ VBEModeInfoBlock + 29	; DB - number of image pages
-VBEModeInfoBlock.Reserved		equ VBEModeInfoBlock + 30	; DB - reserved (0x00 for VBE 1.0-2.0, 0x01 for VBE 3.0)
-; Direct Color fields (required for direct/6 and YUV/7 memory models)
-VBEModeInfoBlock.RedMaskSize		equ VBEModeInfoBlock + 31	; DB - size of direct color red mask in bits
-VBEModeInfoBlock.RedFieldPosition	equ VBEModeInfoBlock + 32	; DB - bit position of lsb of red mask
-VBEModeInfoBlock.GreenMaskSize		equ VBEModeInfoBlock + 33	; DB - size of direct color green mask in bits
-VBEModeInfoBlock.GreenFieldPosition	equ VBEModeInfoBlock + 34	; DB - bit position of lsb of green mask
-VBEModeInfoBlock.BlueMaskSize		equ VBEModeInfoBlock + 35	; DB - size of direct color blue mask in bits
-VBEModeInfoBlock.BlueFieldPosition	equ VBEModeInfoBlock + 36	; DB - bit position of lsb of blue mask
-VBEModeInfoBlock.RsvdMaskSize		equ VBEModeInfoBlock + 37	; DB - size of direct color reserved mask in bits
-VBEModeInfoBlock.RsvdFieldPosition	equ VBEModeInfoBlock + 38	; DB - bit position of lsb of reserved mask
-VBEModeInfoBlock.DirectColorModeInfo	equ VBEModeInfoBlock + 39	; DB - direct color mode attributes
-; Mandatory information for VBE 2.0 and above
-VBEModeInfoBlock.PhysBasePtr		equ VBEModeInfoBlock + 40	; DD - physical address for flat memory frame buffer
-VBEModeInfoBlock.Reserved1		equ VBEModeInfoBlock + 44	; DD - Reserved - always set to 0
-VBEModeInfoBlock.Reserved2		equ VBEModeInfoBlock + 48	; DD - Reserved - always set to 0
-
 ; EOF
@@ -7,14 +7,35 @@
 ; PE https://wiki.osdev.org/PE
 ; GOP https://wiki.osdev.org/GOP
 ; Automatic boot: Assemble and save as /EFI/BOOT/BOOTX64.EFI
-; Add payload up to 60KB
+; Add Pure64 and the payload 4KB into the file. The image is 64KB, or sized for
+; the payload when UEFI_PAYLOAD_SIZE gives its size in bytes
 ; dd if=PAYLOAD of=BOOTX64.EFI bs=4096 seek=1 conv=notrunc > /dev/null 2>&1
 ; =============================================================================
 
-; Set the desired screen resolution values below
+; Set the desired screen resolution values below. The largest 32-bit GOP mode
+; that fits is used, or the smallest if none do. Define NO_VIDEO to boot
+; headless without the GOP
 Horizontal_Resolution		equ 640
 Vertical_Resolution		equ 480
 
+%ifndef PURE64SIZE
+%error "PURE64SIZE must be set to the size of pure64.sys, see build.sh"
+%endif
+
+; Size of the EFI image, which must hold the loader, Pure64, and the payload
+%ifndef UEFI_PAYLOAD_SIZE
+%define UEFI_PAYLOAD_SIZE (61440 - PURE64SIZE)
+%endif
+%ifndef UEFI_IMAGE_SIZE
+%define UEFI_IMAGE_SIZE ((4096 + PURE64SIZE + UEFI_PAYLOAD_SIZE + 4095) & ~4095)
+%endif
+%if 4096 + PURE64SIZE + UEFI_PAYLOAD_SIZE > UEFI_IMAGE_SIZE
+%error "The payload does not fit in UEFI_IMAGE_SIZE"
+%endif
+PAYLOAD_MAGIC			equ 'PL64'	; Payload header, see sysvar.asm
+PAYLOAD_HEADER_SIZE		equ 32
+VBEModeInfoBlock		equ 0x5F00	; Video information for Pure64, see sysvar.asm
+
 BITS 64
 ORG 0x00400000
 %define u(x) __utf16__(x)
@@ -140,7 +161,6 @@ EntryPoint:
 	mov rsi, [CONFIG]
 nextentry:
 	dec rcx
-	cmp rcx, 0
 	je error						; Bail out as no ACPI data was detected
 	mov rdx, [ACPI_TABLE_GUID]				; First 64 bits of the ACPI GUID
 	lodsq
@@ -153,15 +173,16 @@ nextentry:
 	lodsq							; Load the address of the ACPI table
 	mov [ACPI], rax						; Save the address
 
+%ifndef NO_VIDEO
 	; Find the interface to GRAPHICS_OUTPUT_PROTOCOL via its GUID
 	mov rcx, EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID		; IN EFI_GUID *Protocol
-	mov rdx, 0						; IN VOID *Registration OPTIONAL
+	xor edx, edx						; IN VOID *Registration OPTIONAL
 	mov r8, VIDEO						; OUT VOID **Interface
 	mov rax, [BS]
 	mov rax, [rax + EFI_BOOT_SERVICES_LOCATEPROTOCOL]
 	call rax
 	cmp rax, EFI_SUCCESS
-	jne error
+	jne skip_video						; No GOP, boot without a frame buffer
 
 	; Parse the graphics information
 	; Mode Structure
@@ -176,40 +197,57 @@ nextentry:
 	mov rax, [rax]						; RAX holds the address of the Mode structure
 	mov eax, [rax]						; RAX holds UINT32 MaxMode
 	mov [vid_max], rax
-	jmp vid_query
-	
-next_video_mode:
-	mov rax, [vid_current]
-	add rax, 1						; Increment the mode # to check
-	mov [vid_current], rax
-	mov rdx, [vid_max]
-	cmp rax, rdx
-	je skip_set_video					; If we have reached the max then bail out
-	
+	xor ebx, ebx						; EBX holds the score of the best mode
+	xor r12d, r12d						; R12 holds the best mode
+
 vid_query:
+	mov rax, [vid_current]
+	cmp rax, [vid_max]
+	jae vid_set						; Every mode has been checked
+
 	; Query a video mode
 	mov rcx, [VIDEO]					; IN EFI_GRAPHICS_OUTPUT_PROTOCOL *This
 	mov rdx, [vid_current]					; IN UINT32 ModeNumber
 	lea r8, [vid_size]					; OUT UINTN *SizeOfInfo
 	lea r9, [vid_info]					; OUT EFI_GRAPHICS_OUTPUT_MODE_INFORMATION **Info
 	call [rcx + EFI_GRAPHICS_OUTPUT_PROTOCOL_QUERY_MODE]
+	cmp rax, EFI_SUCCESS
+	jne next_video_mode
 
 	; Check mode settings
 	mov rsi, [vid_info]
-	lodsd							; UINT32 - Version
-	lodsd							; UINT32 - HorizontalResolution
+	cmp dword [rsi+12], 2					; PixelFormat 0 and 1 are 32-bit colour modes
+	jae next_video_mode
+	mov eax, [rsi+4]					; HorizontalResolution
+	mov edx, [rsi+8]					; VerticalResolution
 	cmp eax, Horizontal_Resolution
-	jne next_video_mode
-	lodsd							; UINT32 - VerticalResolution
-	cmp eax, Vertical_Resolution
-	jne next_video_mode
-	lodsd							; EFI_GRAPHICS_PIXEL_FORMAT - PixelFormat (UINT32)
-	bt eax, 0						; Bit 0 is set for 32-bit colour mode
-	jnc next_video_mode
+	ja vid_large
+	cmp edx, Vertical_Resolution
+	ja vid_large
+	imul eax, edx
+	add eax, 0x40000000					; A mode that fits scores above any that does not
+	jmp vid_score
+vid_large:
+	imul eax, edx
+	neg eax
+	add eax, 0x40000000					; The smaller the better
+vid_score:
+	cmp eax, ebx
+	jbe next_video_mode
+	mov ebx, eax
+	mov r12, [vid_current]
+
+next_video_mode:
+	add qword [vid_current], 1				; Increment the mode # to check
+	jmp vid_query
+
+vid_set:
+	test ebx, ebx
+	jz skip_set_video					; No 32-bit mode, keep the current one
 
 	; Set the video mode
 	mov rcx, [VIDEO]					; IN EFI_GRAPHICS_OUTPUT_PROTOCOL *This
-	mov rdx, [vid_current]					; IN UINT32 ModeNumber
+	mov rdx, r12						; IN UINT32 ModeNumber
 	call [rcx + EFI_GRAPHICS_OUTPUT_PROTOCOL_SET_MODE]
 
 skip_set_video:
@@ -233,32 +271,68 @@ skip_set_video:
 	mov [HR], rax						; Save the Horizontal Resolution
 	mov eax, [rcx+8]					; RAX holds the Vertical Resolution
 	mov [VR], rax						; Save the Vertical Resolution
+	mov eax, [rcx+32]					; RAX holds the Pixels Per Scan Line
+	mov [PPSL], rax						; Save the Pixels Per Scan Line
+skip_video:
+%endif
 
-	; Copy Pure64 to the correct memory address
+	; Copy Pure64 and the payload header, or a payload without a header, to
+	; 0x8000 as the MBR would
 	mov rsi, PAYLOAD
 	mov rdi, 0x8000
-	mov rcx, 61440						; Copy 60KB
+	mov ecx, PURE64SIZE + PAYLOAD_HEADER_SIZE
+	cmp dword [PAYLOAD+PURE64SIZE], PAYLOAD_MAGIC
+	je copy_pure64
+	mov ecx, 32768						; Pure64 and the payload up to 32KB
+copy_pure64:
 	rep movsb
 	mov ax, [0x8006]
 	cmp ax, 0x3436						; Match against the Pure64 binary
 	jne sig_fail
 
+	; A payload with a header is copied after ExitBootServices, while this
+	; loader is still running. Its copy must not land on the loader image
+	mov rsi, PAYLOAD+PURE64SIZE
+	cmp dword [rsi], PAYLOAD_MAGIC
+	jne payload_checked
+	mov edi, [rsi+12]					; Load address of the payload
+	test byte [rsi+4], 1
+	jz payload_check
+	add edi, [rsi+20]					; LZ4 data is staged after the uncompressed size
+payload_check:
+	mov eax, [rsi+8]					; Size of the payload
+	add rax, rdi						; RAX is the end of the copy
+	cmp rax, START
+	jbe payload_checked					; Ends below the loader
+	cmp rdi, END
+	jb payload_fail						; Starts below the end of the loader
+payload_checked:
+
 	; Signal to Pure64 that it was booted via UEFI
 	mov al, 'U'
 	mov [0x8005], al
 
 	; Save video values to the area of memory where Pure64 expects them
-	mov rdi, 0x00005C00 + 40				; VBEModeInfoBlock.PhysBasePtr
+	mov rdi, VBEModeInfoBlock
+	xor eax, eax
+	mov ecx, 48
+	rep stosd						; Clear the block up to LOADER_RSDP
+	mov rsi, [ACPI]
+	mov ecx, 36
+	rep movsb						; Copy the RSDP to LOADER_RSDP for Pure64
 	mov rax, [FB]
-	stosd
-	mov rdi, 0x00005C00 + 18				; VBEModeInfoBlock.XResolution & .YResolution
+	test rax, rax
+	jz video_saved						; Headless
+	mov [VBEModeInfoBlock + 40], eax			; VBEModeInfoBlock.PhysBasePtr
 	mov rax, [HR]
-	stosw
+	mov [VBEModeInfoBlock + 18], ax				; VBEModeInfoBlock.XResolution
 	mov rax, [VR]
-	stosw
-	mov rdi, 0x00005C00 + 25				; VBEModeInfoBlock.BitsPerPixel
-	mov rax, 32
-	stosb
+	mov [VBEModeInfoBlock + 20], ax				; VBEModeInfoBlock.YResolution
+	mov rax, [PPSL]
+	shl eax, 2						; 4 bytes per pixel
+	mov [VBEModeInfoBlock + 16], ax				; VBEModeInfoBlock.BytesPerScanLine
+	mov byte [VBEModeInfoBlock + 25], 32			; VBEModeInfoBlock.BitsPerPixel
+video_saved:
 
 	mov rcx, [OUTPUT]					; IN EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This
 	lea rdx, [msg_OK]					; IN CHAR16 *String
@@ -267,7 +341,7 @@ skip_set_video:
 	; Get Memory Map
 get_memmap:
 	lea rcx, [memmapsize]					; IN OUT UINTN *MemoryMapSize
-	lea rdx, 0x6000						; OUT EFI_MEMORY_DESCRIPTOR *MemoryMap
+	lea rdx, 0x6010						; OUT EFI_MEMORY_DESCRIPTOR *MemoryMap
 	lea r8, [memmapkey]					; OUT UINTN *MapKey
 	lea r9, [memmapdescsize]				; OUT UINTN *DescriptorSize
 	lea r10, [memmapdescver]				; OUT UINT32 *DescriptorVersion
@@ -281,7 +355,7 @@ get_memmap:
 	je get_memmap						; Attempt again as the memmapsize was updated by EFI
 	cmp rax, EFI_SUCCESS
 	jne error
-	; Output at 0x6000 is as follows:
+	; Output at 0x6010 is as follows:
 	; 0  UINT32 - Type
 	; 8  EFI_PHYSICAL_ADDRESS - PhysicalStart
 	; 16 EFI_VIRTUAL_ADDRESS - VirtualStart
@@ -300,64 +374,35 @@ get_memmap:
 	; Stop interrupts
 	cli
 
-	; Build a 32-bit memory table for 4GiB of identity mapped memory
-	mov rdi, 0x200000
-	mov rax, 0x00000083
-	mov rcx, 1024
-nextpage:
-	stosd
-	add rax, 0x400000
-	dec rcx
-	cmp rcx, 0
-	jne nextpage	
-
-	; Load the custom GDT
-	lgdt [gdtr]
-
-	; Switch to compatibility mode
-	mov rax, SYS32_CODE_SEL					; Compatibility mode
-	push rax
-	lea rax, [compatmode]
-	push rax
-	retfq
-
-BITS 32
-compatmode:
-	; Set the segment registers
-	mov eax, SYS32_DATA_SEL
-	mov ds, ax
-	mov es, ax
-	mov fs, ax
-	mov gs, ax
-	mov ss, ax
-
-	; Deactivate IA-32e mode by clearing CR0.PG
-	mov eax, cr0
-	btc eax, 31						; Clear PG (Bit 31)
-	mov cr0, eax
-
-	; Load CR3
-	mov eax, 0x00200000					; Address of memory map
-	mov cr3, eax
-
-	; Disable IA-32e mode by setting IA32_EFER.LME = 0
-	mov ecx, 0xC0000080					; EFER MSR number
-	rdmsr							; Read EFER
-	and eax, 0xFFFFFEFF 					; Clear LME (Bit 8)
-	wrmsr							; Write EFER
-
-	mov eax, 0x00000010					; Set PSE (Bit 4)
-	mov cr4, eax
-
-	; Enable legacy paged-protected mode by setting CR0.PG
-	mov eax, 0x00000001					; Set PM (Bit 0)
-	mov cr0, eax
-
-	jmp SYS32_CODE_SEL:0x8000				; 32-bit jump to set CS
+	; Save the size of the memory map and of each descriptor for Pure64
+	mov rax, [memmapsize]
+	mov [0x6000], rax
+	mov rax, [memmapdescsize]
+	mov [0x6008], rax
+
+	; Copy a payload with a header straight to its load address
+	mov rsi, PAYLOAD+PURE64SIZE
+	cmp dword [rsi], PAYLOAD_MAGIC
+	jne nopayload
+	mov ecx, [rsi+8]					; Size of the payload
+	mov edi, [rsi+12]					; Load address of the payload
+	test byte [rsi+4], 1
+	jz payload_dest
+	add edi, [rsi+20]					; Stage LZ4 data after the uncompressed size
+payload_dest:
+	add rsi, 32						; Skip the header
+	rep movsb
+nopayload:
+
+	; Jump to the 64-bit entry point of Pure64, which installs its own page
+	; tables and GDT. Low memory is identity mapped by the firmware
+	mov eax, 0x8008
+	jmp rax
 
-BITS 64
 exitfailure:
 	mov rdi, [FB]
+	test rdi, rdi
+	jz halt							; No frame buffer to show the error on
 	mov eax, 0x00FF0000					; Red
 	mov rcx, [FBS]
 	shr rcx, 2						; Quick divide by 4 (32-bit colour)
@@ -368,6 +413,11 @@ error:
 	lea rdx, [msg_error]					; IN CHAR16 *String
 	call [rcx + EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL_OUTPUTSTRING]
 	jmp halt
+payload_fail:
+	mov rcx, [OUTPUT]					; IN EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This
+	lea rdx, [msg_PayloadFail]				; IN CHAR16 *String
+	call [rcx + EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL_OUTPUTSTRING]
+	jmp halt
 sig_fail:
 	mov rcx, [OUTPUT]					; IN EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *This
 	lea rdx, [msg_SigFail]					; IN CHAR16 *String
@@ -377,7 +427,7 @@ halt:
 	jmp halt
 
 
-align 2048
+align 1024
 CODE_END:
 
 ; Data begins here
@@ -395,7 +445,8 @@ FB:			dq 0	; Frame buffer base address
 FBS:			dq 0	; Frame buffer size
 HR:			dq 0	; Horizontal Resolution
 VR:			dq 0	; Vertical Resolution
-memmapsize:		dq 8192
+PPSL:			dq 0	; Pixels Per Scan Line
+memmapsize:		dq 8176					; 0x6010 - 0x7FFF
 memmapkey:		dq 0
 memmapdescsize:		dq 0
 memmapdescver:		dq 0
@@ -417,31 +468,13 @@ db 0x96, 0xfb, 0x7a, 0xde, 0xd0, 0x80, 0x51, 0x6a
 hextable: 		db '0123456789ABCDEF'
 msg_error:		dw u('Error'), 0
 msg_SigFail:		dw u('Bad Sig!'), 0
+msg_PayloadFail:	dw u('Payload overlaps the loader!'), 0
 msg_OK:			dw u('OK'), 0
 
-align 16
-gdtr:					; Global Descriptors Table Register
-dw gdt_end - gdt - 1			; limit of GDT (size minus one)
-dq gdt					; linear address of GDT
-
-align 16
-gdt:
-SYS64_NULL_SEL equ $-gdt		; Null Segment
-dq 0x0000000000000000
-SYS32_CODE_SEL equ $-gdt		; 32-bit code descriptor
-dq 0x00CF9A000000FFFF			; 55 Granularity 4KiB, 54 Size 32bit, 47 Present, 44 Code/Data, 43 Executable, 41 Readable
-SYS32_DATA_SEL equ $-gdt		; 32-bit data descriptor
-dq 0x00CF92000000FFFF			; 55 Granularity 4KiB, 54 Size 32bit, 47 Present, 44 Code/Data, 41 Writeable
-SYS64_CODE_SEL equ $-gdt		; 64-bit code segment, read/execute, nonconforming
-dq 0x00209A0000000000			; 53 Long mode code, 47 Present, 44 Code/Data, 43 Executable, 41 Readable
-SYS64_DATA_SEL equ $-gdt		; 64-bit data segment, read/write, expand down
-dq 0x0000920000000000			; 47 Present, 44 Code/Data, 41 Writable
-gdt_end:
-
-align 4096
+times 4096-($-$$) db 0			; The payload starts 4KB into the file, see dd above
 PAYLOAD:
 
-align 65536				; Pad out to 64K
+times UEFI_IMAGE_SIZE-($-$$) db 0	; Pad out to the image size
 DATA_END:
 END:
 
@@ -2,49 +2,36 @@
 ; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
 ; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
 ;
-; INIT ACPI
+; INIT ACPI - Find the RSDP, list every ACPI table in the directory, and
+; parse the tables Pure64 needs. This code is called by the BSP
 ; =============================================================================
 
 
 init_acpi:
 	mov al, [p_BootMode]
 	cmp al, 'U'
-	je foundACPIfromUEFI
-	mov esi, 0x000E0000		; Start looking for the Root System Description Pointer Structure
-	mov rbx, 'RSD PTR '		; This in the Signature for the ACPI Structure Table (0x2052545020445352)
-searchingforACPI:
-	lodsq				; Load a quad word from RSI and store in RAX, then increment RSI by 8
-	cmp rax, rbx
+	je init_acpi_loader
+	cmp al, 'M'
+	jne init_acpi_scan
+init_acpi_loader:
+	mov esi, LOADER_RSDP		; The UEFI and Multiboot2 loaders pass a copy of the RSDP
+	call acpi_check_rsdp
+	je foundACPI			; Otherwise scan for it as on a BIOS system
+init_acpi_scan:
+	mov esi, [p_EBDAAddress]	; The RSDP may be in the first 1KiB of the EBDA
+	cmp esi, 0
+	je init_acpi_scan_bios
+	mov ecx, 1024 / 16
+	call acpi_find_rsdp
 	je foundACPI
-	cmp esi, 0x000FFFFF		; Keep looking until we get here
-	jge noACPI			; ACPI tables couldn't be found, Fail.
-	jmp searchingforACPI
-
-foundACPIfromUEFI:
-	mov rsi, [0x400830]		; TODO This should be passed properly
-	mov rbx, 'RSD PTR '		; This in the Signature for the ACPI Structure Table (0x2052545020445352)
-	lodsq
-	cmp rax, rbx
-	jne noACPI
-
-foundACPI:				; Found a Pointer Structure, verify the checksum
-	push rsi
-	xor ebx, ebx
-	mov ecx, 20			; As per the spec only the first 20 bytes matter
-	sub rsi, 8			; Bytes 0 thru 19 must sum to zero
-nextchecksum:
-	lodsb				; Get a byte
-	add bl, al			; Add it to the running total
-	sub cl, 1
-	cmp cl, 0
-	jne nextchecksum
-	pop rsi
-	cmp bl, 0
-	jne searchingforACPI		; Checksum didn't check out? Then keep looking.
-
-	lodsb				; Checksum
-	lodsd				; OEMID (First 4 bytes)
-	lodsw				; OEMID (Last 2 bytes)
+init_acpi_scan_bios:
+	mov esi, 0x000E0000		; Or in the BIOS area from 0xE0000 to 0xFFFFF
+	mov ecx, 0x20000 / 16
+	call acpi_find_rsdp
+	jne noACPI			; ACPI tables couldn't be found, Fail.
+
+foundACPI:				; RSI points to a Pointer Structure with a valid checksum
+	add rsi, 15
 	lodsb				; Grab the Revision value (0 is v1.0, 1 is v2.0, 2 is v3.0, etc)
 	cmp al, 0
 	je foundACPIv1			; If AL is 0 then the system is using ACPI v1.0
@@ -54,58 +41,42 @@ foundACPIv1:
 	xor eax, eax
 	lodsd				; Grab the 32 bit physical address of the RSDT (Offset 16).
 	mov rsi, rax			; RSI now points to the RSDT
-	lodsd				; Grab the Signature
-	cmp eax, 'RSDT'			; Make sure the signature is valid
+	cmp dword [rsi], 'RSDT'		; Make sure the signature is valid
 	jne novalidacpi			; Not the same? Bail out
-	sub rsi, 4
-	mov [p_ACPITableAddress], rsi	; Save the RSDT Table Address
-	add rsi, 4
-	xor eax, eax
-	lodsd				; Length
-	add rsi, 28			; Skip to the Entry offset
-	sub eax, 36			; EAX holds the table size. Subtract the preamble
-	shr eax, 2			; Divide by 4
-	mov rdx, rax			; RDX is the entry count
-	xor ecx, ecx
-foundACPIv1_nextentry:
-	lodsd
-	push rax
-	add ecx, 1
-	cmp ecx, edx
-	je findACPITables
-	jmp foundACPIv1_nextentry
+	mov r10d, 4			; R10 holds the size of each entry
+	jmp foundACPIsdt
 
 foundACPIv2:
 	lodsd				; RSDT Address
 	lodsd				; Length
 	lodsq				; Grab the 64 bit physical address of the XSDT (Offset 24).
 	mov rsi, rax			; RSI now points to the XSDT
-	lodsd				; Grab the Signature
-	cmp eax, 'XSDT'			; Make sure the signature is valid
+	cmp dword [rsi], 'XSDT'		; Make sure the signature is valid
 	jne novalidacpi			; Not the same? Bail out
-	sub rsi, 4
-	mov [p_ACPITableAddress], rsi	; Save the XSDT Table Address
-	add rsi, 4
-	xor eax, eax
-	lodsd				; Length
-	add rsi, 28			; Skip to the start of the Entries (offset 36)
-	sub eax, 36			; EAX holds the table size. Subtract the preamble
-	shr eax, 3			; Divide by 8
-	mov rdx, rax			; RDX is the entry count
-	xor ecx, ecx
-foundACPIv2_nextentry:
-	lodsq
-	push rax
-	add ecx, 1
-	cmp ecx, edx
-	jne foundACPIv2_nextentry
+	mov r10d, 8			; R10 holds the size of each entry
+
+foundACPIsdt:
+	mov [p_ACPITableAddress], rsi	; Save the RSDT or XSDT Table Address
+	call acpi_add_table
+	mov r9d, [rsi+4]		; Length
+	add r9, rsi			; R9 holds the end of the table
+	lea r8, [rsi+36]		; R8 points to the first entry
 
 findACPITables:
-	xor ecx, ecx
+checkACPITable:
+	lea rax, [r8+r10]
+	cmp rax, r9
+	ja init_smp_acpi_done		; No more entries
+	mov esi, [r8]			; 32-bit RSDT entry
+	cmp r10d, 4
+	je nextACPITable
+	mov rsi, [r8]			; 64-bit XSDT entry
 nextACPITable:
-	pop rsi
+	add r8, r10
+	cmp rsi, 0
+	je checkACPITable
+	call acpi_add_table
 	lodsd
-	add ecx, 1
 	mov ebx, 'APIC'			; Signature for the Multiple APIC Description Table
 	cmp eax, ebx
 	je foundAPICTable
@@ -115,21 +86,60 @@ nextACPITable:
 	mov ebx, 'MCFG'			; Signature for the PCIe Enhanced Configuration Mechanism
 	cmp eax, ebx
 	je foundMCFGTable
-	cmp ecx, edx
-	jne nextACPITable
-	jmp init_smp_acpi_done		;noACPIAPIC
+	mov ebx, 'SRAT'			; Signature for the System Resource Affinity Table
+	cmp eax, ebx
+	je foundSRATTable
+	mov ebx, 'SLIT'			; Signature for the System Locality Distance Information Table
+	cmp eax, ebx
+	je foundSLITTable
+	mov ebx, 'FACP'			; Signature for the Fixed ACPI Description Table
+	cmp eax, ebx
+	je foundFADTTable
+	jmp checkACPITable
 
 foundAPICTable:
 	call parseAPICTable
-	jmp nextACPITable
+	jmp checkACPITable
 
 foundHPETTable:
 	call parseHPETTable
-	jmp nextACPITable
+	jmp checkACPITable
 
 foundMCFGTable:
 	call parseMCFGTable
-	jmp nextACPITable
+	jmp checkACPITable
+
+foundSRATTable:
+	sub rsi, 4
+	mov [p_SRATAddress], rsi	; Parsed by init_numa once the CPU and memory tables are complete
+	jmp checkACPITable
+
+foundSLITTable:
+	call parseSLITTable
+	jmp checkACPITable
+
+foundFADTTable:				; The DSDT and FACS are only listed in the FADT
+	sub rsi, 4
+	mov ecx, [rsi+4]		; Length of the FADT
+	mov eax, [rsi+36]		; FIRMWARE_CTRL
+	cmp ecx, 140
+	jb foundFADTTable_facs
+	cmp qword [rsi+132], 0
+	je foundFADTTable_facs
+	mov rax, [rsi+132]		; X_FIRMWARE_CTRL
+foundFADTTable_facs:
+	mov edx, [rsi+40]		; DSDT
+	cmp ecx, 148
+	jb foundFADTTable_dsdt
+	cmp qword [rsi+140], 0
+	je foundFADTTable_dsdt
+	mov rdx, [rsi+140]		; X_DSDT
+foundFADTTable_dsdt:
+	mov rsi, rax
+	call acpi_add_table
+	mov rsi, rdx
+	call acpi_add_table
+	jmp checkACPITable
 
 init_smp_acpi_done:
 	ret
@@ -139,6 +149,79 @@ novalidacpi:
 	jmp $
 
 
+; -----------------------------------------------------------------------------
+; acpi_find_rsdp -- Look for the RSDP on 16-byte boundaries
+;  IN:	RSI = Start of the area
+;	ECX = Size of the area in 16-byte units
+; OUT:	ZF set and RSI = Address of the RSDP if it was found
+;	ECX is modified
+acpi_find_rsdp:
+	call acpi_check_rsdp
+	je acpi_find_rsdp_done
+	add rsi, 16
+	dec ecx
+	jnz acpi_find_rsdp
+	cmp rsi, 0			; Clear ZF, the area is not at 0
+acpi_find_rsdp_done:
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; acpi_check_rsdp -- Check the signature and checksum of an RSDP
+; As per the spec only the first 20 bytes are in the checksum
+;  IN:	RSI = Address of the RSDP
+; OUT:	ZF set if it is valid, all registers preserved
+acpi_check_rsdp:
+	push rcx
+	push rbx
+	push rax
+	mov rax, 'RSD PTR '		; This in the Signature for the ACPI Structure Table (0x2052545020445352)
+	cmp [rsi], rax
+	jne acpi_check_rsdp_done
+	xor ebx, ebx
+	xor ecx, ecx
+acpi_check_rsdp_next:
+	add bl, [rsi+rcx]		; Bytes 0 thru 19 must sum to zero
+	inc ecx
+	cmp ecx, 20
+	jne acpi_check_rsdp_next
+	cmp bl, 0
+acpi_check_rsdp_done:
+	pop rax
+	pop rbx
+	pop rcx
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; acpi_add_table -- Add a table to the ACPI table directory
+;  IN:	RSI = Address of the table, 0 if there is none
+; OUT:	Nothing, all registers preserved
+acpi_add_table:
+	push rdi
+	push rax
+	cmp rsi, 0
+	je acpi_add_table_done
+	movzx edi, word [p_ACPITables]
+	cmp edi, IM_ACPI_TABLES_MAX
+	jae acpi_add_table_done		; The directory is full
+	inc word [p_ACPITables]
+	shl edi, 4
+	add edi, IM_ACPI_TABLES
+	mov eax, [rsi]			; Signature
+	mov [rdi], eax
+	mov eax, [rsi+4]		; Length
+	mov [rdi+4], eax
+	mov [rdi+8], rsi		; Address
+acpi_add_table_done:
+	pop rax
+	pop rdi
+	ret
+; -----------------------------------------------------------------------------
+
+
 ; -----------------------------------------------------------------------------
 parseAPICTable:
 	push rcx
@@ -158,7 +241,6 @@ parseAPICTable:
 	lodsd				; Local APIC Address (This should match what was pulled already via the MSR)
 	lodsd				; Flags (1 = Dual 8259 Legacy PICs Installed)
 	add ebx, 44
-	mov rdi, 0x0000000000005100	; Valid CPU IDs
 
 readAPICstructures:
 	cmp ebx, ecx
@@ -172,8 +254,8 @@ readAPICstructures:
 	je APICinterruptsourceoverride
 ;	cmp al, 0x03			; Non-maskable Interrupt Source (NMI)
 ;	je APICnmi
-;	cmp al, 0x04			; Local APIC NMI
-;	je APIClocalapicnmi
+	cmp al, 0x04			; Local APIC NMI
+	je APIClocalapicnmi
 ;	cmp al, 0x05			; Local APIC Address Override
 ;	je APICaddressoverride
 ;	cmp al, 0x06			; I/O SAPIC Structure
@@ -182,10 +264,10 @@ readAPICstructures:
 ;	je APIClocalsapic
 ;	cmp al, 0x08			; Platform Interrupt Source Structure
 ;	je APICplatformint
-;	cmp al, 0x09			; Processor Local x2APIC
-;	je APICx2apic
-;	cmp al, 0x0A			; Local x2APIC NMI
-;	je APICx2nmi
+	cmp al, 0x09			; Processor Local x2APIC
+	je APICx2apic
+	cmp al, 0x0A			; Local x2APIC NMI
+	je APICx2nmi
 
 	jmp APICignore
 
@@ -200,10 +282,8 @@ APICapic:				; Entry Type 0
 	lodsd				; Flags (Bit 0 set if enabled/usable)
 	bt eax, 0			; Test to see if usable
 	jnc readAPICstructures		; Read the next structure if CPU not usable
-	inc word [p_cpu_detected]
 	xchg eax, edx			; Restore the APIC ID back to EAX
-	stosb
-	jmp readAPICstructures		; Read the next structure
+	jmp APICsavecpu			; Save the APIC ID and read the next structure
 
 APICioapic:				; Entry Type 1
 	xor eax, eax
@@ -253,22 +333,84 @@ APICinterruptsourceoverride:		; Entry Type 2
 	inc byte [p_IOAPICIntSourceC]
 	jmp readAPICstructures		; Read the next structure
 
-;APICx2apic:				; Entry Type 9
-;	xor eax, eax
-;	xor edx, edx
-;	lodsb				; Length (will be set to 16)
-;	add ebx, eax
-;	lodsw				; Reserved; Must be Zero
-;	lodsd
-;	xchg eax, edx			; Save the x2APIC ID to EDX
-;	lodsd				; Flags (Bit 0 set if enabled/usable)
-;	bt eax, 0			; Test to see if usable
-;	jnc APICx2apicEnd		; Read the next structure if CPU not usable
-;	xchg eax, edx			; Restore the x2APIC ID back to EAX
-;	; TODO - Save the ID's somewhere
-;APICx2apicEnd:
-;	lodsd				; ACPI Processor UID
-;	jmp readAPICstructures		; Read the next structure
+APIClocalapicnmi:			; Entry Type 4
+	xor eax, eax
+	xor edx, edx
+	lodsb				; Length (will be set to 6)
+	add ebx, eax
+	lodsb				; ACPI Processor ID (0xFF is all processors)
+	mov dl, al
+	lodsw				; Flags
+	lodsb				; Local APIC LINT#
+	cmp dl, 0xFF			; Only entries that apply to all processors are used
+	jne readAPICstructures		; Read the next structure
+	mov [p_NMI_LINT], al		; Save the LINT# that NMI is connected to
+	jmp readAPICstructures		; Read the next structure
+
+APICx2apic:				; Entry Type 9
+	xor eax, eax
+	xor edx, edx
+	lodsb				; Length (will be set to 16)
+	add ebx, eax
+	lodsw				; Reserved; Must be Zero
+	lodsd
+	xchg eax, edx			; Save the x2APIC ID to EDX
+	lodsd				; Flags (Bit 0 set if enabled/usable)
+	bt eax, 0			; Test to see if usable
+	lodsd				; ACPI Processor UID
+	jnc readAPICstructures		; Read the next structure if CPU not usable
+	xchg eax, edx			; Restore the x2APIC ID back to EAX
+	jmp APICsavecpu			; Save the APIC ID and read the next structure
+
+APICx2nmi:				; Entry Type 10
+	xor eax, eax
+	xor edx, edx
+	lodsb				; Length (will be set to 12)
+	add ebx, eax
+	lodsw				; Flags
+	lodsd				; ACPI Processor UID (0xFFFFFFFF is all processors)
+	mov edx, eax
+	lodsb				; Local x2APIC LINT#
+	add rsi, 3			; Reserved
+	cmp edx, 0xFFFFFFFF		; Only entries that apply to all processors are used
+	jne readAPICstructures		; Read the next structure
+	mov [p_NMI_LINT], al		; Save the LINT# that NMI is connected to
+	jmp readAPICstructures		; Read the next structure
+
+APICsavecpu:				; EAX holds the APIC ID of a usable CPU
+	push rcx
+	push rdi
+	xor ecx, ecx
+	mov cx, [p_cpu_detected]
+	cmp ecx, IM_CPU_MAX		; Is the CPU table full?
+	jae APICsavecpu_done
+	mov rdi, IM_CPU_APICID
+APICsavecpu_check:			; Some firmware lists a CPU as both type 0 and type 9
+	jrcxz APICsavecpu_new
+	dec ecx
+	cmp eax, [rdi+rcx*4]
+	je APICsavecpu_done		; Already in the table
+	jmp APICsavecpu_check
+APICsavecpu_new:
+	mov cx, [p_cpu_detected]
+	mov [rdi+rcx*4], eax		; Save the 32-bit APIC ID to the CPU table
+	cmp eax, 0xFF			; Does the APIC ID fit in the 8-bit list?
+	jb APICsavecpu_byte
+	mov byte [p_x2APIC], 1		; This CPU can only be started in x2APIC mode
+	cmp ecx, 256
+	jae APICsavecpu_count
+	mov byte [0x5100+rcx], 0xFF	; Mark the 8-bit list entry as not valid
+	jmp APICsavecpu_count
+APICsavecpu_byte:
+	cmp ecx, 256
+	jae APICsavecpu_count
+	mov [0x5100+rcx], al		; Save the 8-bit APIC ID to the legacy list
+APICsavecpu_count:
+	inc word [p_cpu_detected]
+APICsavecpu_done:
+	pop rdi
+	pop rcx
+	jmp readAPICstructures		; Read the next structure
 
 APICignore:
 	xor eax, eax
@@ -307,6 +449,26 @@ parseHPETTable:
 ; -----------------------------------------------------------------------------
 
 
+; -----------------------------------------------------------------------------
+parseSLITTable:
+	push rdi
+	push rcx
+	mov rax, [rsi+32]		; Number of System Localities (offset 36)
+	cmp rax, IM_NUMA_SLIT_MAX
+	ja parseSLITTable_done		; Too many to fit in the InfoMap table
+	mov [p_NUMALocalities], ax
+	mov ecx, eax
+	imul ecx, ecx			; The matrix has one byte per pair of localities
+	add rsi, 40			; Entries start at offset 44
+	mov edi, IM_NUMA_SLIT
+	rep movsb
+parseSLITTable_done:
+	pop rcx
+	pop rdi
+	ret
+; -----------------------------------------------------------------------------
+
+
 ; -----------------------------------------------------------------------------
 parseMCFGTable:
 	push rdi
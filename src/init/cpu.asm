@@ -8,6 +8,59 @@
 
 init_cpu:
 
+; Program the Page Attribute Table so every core uses the same layout
+; From the power-on layout only PA4 and PA5 change and nothing on this core has
+; used them yet, so a TLB flush is enough and the caches do not need to be
+; flushed for this. A layout set by the firmware is replaced as well, but its
+; entries may be in use so the caches are flushed around the change
+	mov eax, 1
+	cpuid
+	bt edx, 16			; PAT is supported if bit 16 is set
+	jnc init_cpu_pat_done
+	mov ecx, 0x00000277		; IA32_PAT
+	rdmsr
+	cmp eax, PAT_VALUE_LOW
+	jne init_cpu_pat_check
+	cmp edx, PAT_VALUE_HIGH
+	je init_cpu_pat_done		; Already programmed
+init_cpu_pat_check:
+	cmp eax, PAT_RESET_LOW
+	jne init_cpu_pat_firmware
+	cmp edx, PAT_RESET_HIGH
+	jne init_cpu_pat_firmware
+	mov eax, PAT_VALUE_LOW
+	mov edx, PAT_VALUE_HIGH
+	wrmsr
+	mov rax, cr4
+	btr rax, 7			; Clearing PGE also flushes the global pages from the TLB
+	mov cr4, rax
+	jmp init_cpu_pat_done
+init_cpu_pat_firmware:
+	mov rax, cr0
+	btr rax, 29			; Clear No Write Thru (Bit 29)
+	bts rax, 30			; Set Cache Disable (Bit 30)
+	mov cr0, rax
+	wbinvd
+	mov rax, cr4
+	btr rax, 7			; Clearing PGE also flushes the global pages from the TLB
+	mov cr4, rax
+	mov ecx, 0x00000277		; IA32_PAT
+	mov eax, PAT_VALUE_LOW
+	mov edx, PAT_VALUE_HIGH
+	wrmsr
+	wbinvd
+	mov rax, cr3			; Flush the TLB again with the new layout
+	mov cr3, rax
+	mov rax, cr0
+	btr rax, 30			; Clear CD (Bit 30)
+	mov cr0, rax
+init_cpu_pat_done:
+
+; Skip the cache disable sequence if the MTRRs already match the values chosen
+; by the BSP. Each WBINVD stalls the whole package so this is worth it
+	call mtrr_check
+	jnc init_cpu_cache_done
+
 ; Disable Cache
 	mov rax, cr0
 	btr rax, 29			; Clear No Write Thru (Bit 29)
@@ -24,39 +77,8 @@ init_cpu:
 	mov rax, cr3
 	mov cr3, rax
 
-; Disable MTRRs and Configure default memory type to UC
-	mov ecx, 0x000002FF
-	rdmsr
-	and eax, 0xFFFFF300		; Clear MTRR Enable (Bit 11), Fixed Range MTRR Enable (Bit 10), and Default Memory Type (Bits 7:0) to UC (0x00)
-	wrmsr
-
-; Setup variable-size address ranges
-; Cache 0-64 MiB as type 6 (WB) cache
-; See example in Intel Volume 3A. Example Base and Mask Calculations
-;	mov ecx, 0x00000200		; MTRR_Phys_Base_MSR(0)
-;	mov edx, 0x00000000		; Base is EDX:EAX, 0x0000000000000006
-;	mov eax, 0x00000006		; Type 6 (write-back cache)
-;	wrmsr
-;	mov ecx, 0x00000201		; MTRR_Phys_Mask_MSR(0)
-;;	mov edx, 0x00000000		; Mask is EDX:EAX, 0x0000000001000800 (Because bochs sucks)
-;;	mov eax, 0x01000800		; Bit 11 set for Valid
-;	mov edx, 0x0000000F		; Mask is EDX:EAX, 0x0000000F80000800 (2 GiB)
-;	mov eax, 0x80000800		; Bit 11 set for Valid
-;	wrmsr
-
-; MTRR notes:
-; Base 0x0000000000000000 = 0 MiB
-; Base 0x0000000080000000 = 2048 MiB, 2048 is 0x800
-; Base 0x0000000100000000 = 4096 MiB, 4096 is 0x1000
-; Mask 0x0000000F80000000 = 2048 MiB, 0xFFFFFFFFF - F80000000 = 7FFFFFFF = 2147483647 (~2 GiB)
-; Mask 0x0000000FC0000000 = 1024 MiB, 0xFFFFFFFFF - FC0000000 = 3FFFFFFF = 1073741823 (~1 GiB)
-; Mask 0x0000000FFC000000 = 64 MiB,   0xFFFFFFFFF - FFC000000 =  3FFFFFF =   67108863 (~64 MiB)
-
-; Enable MTRRs
-	mov ecx, 0x000002FF
-	rdmsr
-	bts eax, 11			; Set MTRR Enable (Bit 11), Only enables Variable Range MTRR's
-	wrmsr
+; Load the MTRR values chosen by the BSP so every core has identical settings
+	call mtrr_load
 
 ; Flush Cache
 	wbinvd
@@ -66,11 +88,14 @@ init_cpu:
 	btr rax, 29			; Clear No Write Thru (Bit 29)
 	btr rax, 30			; Clear CD (Bit 30)
 	mov cr0, rax
+init_cpu_cache_done:
 
-; Enable Paging Global Extensions
-;	mov rax, cr4
-;	bts rax, 7			; Set Paging Global Extensions (Bit 7)
-;	mov cr4, rax
+; Enable the CR4 features chosen by the BSP (PGE, PCIDE, FSGSBASE)
+	mov rax, cr4
+	btr rax, 7			; Paging Global Extensions stay off unless chosen
+	mov edx, [p_CR4Features]
+	or rax, rdx
+	mov cr4, rax
 
 ; Enable Floating Point
 	mov rax, cr0
@@ -87,22 +112,19 @@ init_cpu:
 ; Enable Math Co-processor
 	finit
 
-; Enable AVX
-	mov eax, 1			; CPUID Feature information 1
-	cpuid				; Sets info in eax and ecx
-	bt ecx, 28			; AVX is supported if bit 28 is set in ecx
-	jnc avx_not_supported		; Skip activating AVX if not supported
-avx_supported:
+; Enable the XSAVE state components chosen by the BSP (AVX, AVX-512, AMX, ...)
+	cmp qword [p_XCR0], 0
+	je init_cpu_xsave_done		; XSAVE is not supported
 	mov rax, cr4
 	bts rax, 18			; Enable OSXSAVE (Bit 18)
 	mov cr4, rax
-	mov rcx, 0			; Set load XCR Nr. 0
-	xgetbv				; Load XCR0 register
-	bts rax, 0			; Set X87 enable (Bit 0)
-	bts rax, 1			; Set SSE enable (Bit 1)
-	bts rax, 2			; Set AVX enable (Bit 2)
-	xsetbv				; Save XCR0 register
-avx_not_supported:
+	xor ecx, ecx			; XCR0
+	mov eax, [p_XCR0]
+	mov edx, [p_XCR0+4]
+	xsetbv
+init_cpu_xsave_done:
+
+	call cpu_power			; Apply the power policy chosen by the BSP
 
 ; Enable and Configure Local APIC
 	mov ecx, APIC_TPR
@@ -114,17 +136,30 @@ avx_not_supported:
 	mov ecx, APIC_LVT_PERF
 	mov eax, 0x00010000
 	call apic_write			; Disable performance counter interrupts
+%ifndef NO_X2APIC
+	cmp byte [p_x2APIC], 1		; In x2APIC mode the LDR is read-only and the DFR does not exist
+	je init_cpu_skip_ldr
+%endif
 	mov ecx, APIC_LDR
 	xor eax, eax
 	call apic_write			; Set Logical Destination Register
 	mov ecx, APIC_DFR
 	not eax				; Set EAX to 0xFFFFFFFF; Bits 31-28 set for Flat Mode
 	call apic_write			; Set Destination Format Register
+init_cpu_skip_ldr:
 	mov ecx, APIC_LVT_LINT0
 	mov eax, 0x00008700		; Bit 15 (1 = Level), Bits 10:8 for Ext
+	cmp byte [p_NMI_LINT], 0	; Is NMI connected to LINT0?
+	jne init_cpu_lint0
+	mov eax, 0x00000400		; Bits 10:8 for NMI
+init_cpu_lint0:
 	call apic_write			; Enable normal external interrupts
 	mov ecx, APIC_LVT_LINT1
-	mov eax, 0x00000400
+	mov eax, 0x00000400		; Bits 10:8 for NMI
+	cmp byte [p_NMI_LINT], 1	; Is NMI connected to LINT1?
+	je init_cpu_lint1
+	mov eax, 0x00008700		; Bit 15 (1 = Level), Bits 10:8 for Ext
+init_cpu_lint1:
 	call apic_write			; Enable normal NMI processing
 	mov ecx, APIC_LVT_ERR
 	mov eax, 0x00010000
@@ -133,15 +168,13 @@ avx_not_supported:
 	mov eax, 0x000001FF
 	call apic_write			; Enable the APIC (bit 8) and set spurious vector to 0xFF
 
-	lock inc word [p_cpu_activated]
-	mov ecx, APIC_ID
-	call apic_read			; APIC ID is stored in bits 31:24
-	shr rax, 24			; AL now holds the CPU's APIC ID (0 - 255)
-	mov rdi, 0x00005700		; The location where the cpu values are stored
-	add rdi, rax			; RDI points to InfoMap CPU area + APIC ID. ex 0x5701 would be APIC ID 1
-	mov al, 1
-	stosb
+	call cpu_index			; ECX holds the position of this CPU in the CPU table
+	jc init_cpu_done		; Not listed in the MADT
+	call cpu_topology		; Fill in the topology record before checking in
+	mov byte [IM_CPU_STATUS+rcx], 1	; Mark the CPU as activated
 
+init_cpu_done:
+	lock inc word [p_cpu_activated]
 	ret
 
 ; -----------------------------------------------------------------------------
@@ -150,12 +183,27 @@ avx_not_supported:
 ; OUT:	EAX = Register value
 ;	All other registers preserved
 apic_read:
+%ifndef NO_X2APIC
+	cmp byte [p_x2APIC], 1
+	je apic_read_x2apic
+%endif
 	push rsi
 	mov rsi, [p_LocalAPICAddress]
 	add rsi, rcx			; Add offset
 	lodsd
 	pop rsi
 	ret
+%ifndef NO_X2APIC
+apic_read_x2apic:			; In x2APIC mode the registers are MSRs starting at 0x800
+	push rcx
+	push rdx
+	shr ecx, 4			; MMIO offsets are 16 bytes apart
+	add ecx, 0x800
+	rdmsr
+	pop rdx
+	pop rcx
+	ret
+%endif
 ; -----------------------------------------------------------------------------
 
 
@@ -165,15 +213,638 @@ apic_read:
 ;	EAX = Value to write
 ; OUT:	All registers preserved
 apic_write:
+%ifndef NO_X2APIC
+	cmp byte [p_x2APIC], 1
+	je apic_write_x2apic
+%endif
 	push rdi
 	mov rdi, [p_LocalAPICAddress]
 	add rdi, rcx			; Add offset
 	stosd
 	pop rdi
 	ret
+%ifndef NO_X2APIC
+apic_write_x2apic:			; In x2APIC mode the registers are MSRs starting at 0x800
+	push rcx
+	push rdx
+	shr ecx, 4			; MMIO offsets are 16 bytes apart
+	add ecx, 0x800
+	xor edx, edx
+	wrmsr
+	pop rdx
+	pop rcx
+	ret
+%endif
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; apic_send_ipi -- Send an Inter-Processor Interrupt
+;  IN:	EAX = Interrupt Command Register bits 31-0 (vector, type, and shorthand)
+;	EDX = Destination APIC ID (ignored if a shorthand is used)
+; OUT:	All registers preserved
+apic_send_ipi:
+	push rcx
+	push rdx
+	push rax
+%ifndef NO_X2APIC
+	cmp byte [p_x2APIC], 1
+	je apic_send_ipi_x2apic
+%endif
+	push rdi
+	mov rdi, [p_LocalAPICAddress]
+	shl edx, 24			; Destination is stored in bits 31:24
+	mov dword [rdi+APIC_ICRH], edx	; Interrupt Command Register (ICR); bits 63-32
+	mov dword [rdi+APIC_ICRL], eax	; Interrupt Command Register (ICR); bits 31-0
+apic_send_ipi_verify:
+	mov eax, [rdi+APIC_ICRL]	; Interrupt Command Register (ICR); bits 31-0
+	bt eax, 12			; Verify that the command completed
+	jc apic_send_ipi_verify
+	pop rdi
+%ifndef NO_X2APIC
+	jmp apic_send_ipi_done
+apic_send_ipi_x2apic:			; The x2APIC ICR is a single 64-bit MSR with no pending bit
+	mov ecx, 0x00000830		; EDX:EAX is the full 32-bit destination and the command
+	mfence				; WRMSR to the ICR is not serializing
+	wrmsr
+%endif
+apic_send_ipi_done:
+	pop rax
+	pop rdx
+	pop rcx
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; apic_id -- Read the APIC ID of the current CPU
+;  IN:	Nothing
+; OUT:	EAX = APIC ID (8-bit in xAPIC mode, 32-bit in x2APIC mode)
+;	All other registers preserved
+apic_id:
+	push rcx
+	mov ecx, APIC_ID
+	call apic_read
+%ifndef NO_X2APIC
+	cmp byte [p_x2APIC], 1
+	je apic_id_done			; The x2APIC ID is the full register
+%endif
+	shr eax, 24			; The xAPIC ID is stored in bits 31:24
+apic_id_done:
+	pop rcx
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; cpu_index -- Find the position of the current CPU in the CPU table
+;  IN:	Nothing
+; OUT:	ECX = CPU table index, Carry set if the CPU is not in the table
+;	All other registers preserved
+cpu_index:
+	push rsi
+	push rdx
+	push rax
+	call apic_id
+	mov rsi, IM_CPU_APICID
+	xor ecx, ecx
+	xor edx, edx
+	mov dx, [p_cpu_detected]
+cpu_index_next:
+	cmp ecx, edx
+	jae cpu_index_fail
+	cmp eax, [rsi+rcx*4]
+	je cpu_index_done		; Found it, carry is clear
+	inc ecx
+	jmp cpu_index_next
+cpu_index_fail:
+	xor ecx, ecx
+	stc
+cpu_index_done:
+	pop rax
+	pop rdx
+	pop rsi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; cpu_prepare -- Choose the CR4 features and the XCR0 value for all cores
+; PGE, PCIDE, and FSGSBASE are used if supported and cfg_cr4 is set. Every XSAVE
+; state component in CPUID leaf 0xD is enabled, the AMX tile state only if
+; cfg_amx is set. The size of the XSAVE area is found for that XCR0 value.
+; If cfg_power is set the power settings for cpu_power are chosen as well.
+; This is called by the BSP
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+cpu_prepare:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	xor eax, eax
+	cpuid
+	mov esi, eax			; ESI holds the highest standard CPUID leaf
+
+; Power policy
+	cmp byte [cfg_power], 1
+	jne cpu_prepare_power_done
+	cmp esi, 6
+	jb cpu_prepare_turbo
+	mov eax, 6
+	cpuid
+	bt eax, 7			; HWP is supported if bit 7 is set
+	jnc cpu_prepare_epb
+	or byte [p_PowerPolicy], POWER_HWP
+	bt eax, 10			; The HWP energy-performance preference is supported if bit 10 is set
+	jnc cpu_prepare_epb
+	or byte [p_PowerPolicy], POWER_EPP
+	jmp cpu_prepare_pref
+cpu_prepare_epb:
+	bt ecx, 3			; IA32_ENERGY_PERF_BIAS is supported if bit 3 is set
+	jnc cpu_prepare_turbo
+	or byte [p_PowerPolicy], POWER_EPB
+cpu_prepare_pref:
+	mov al, [cfg_epp]
+	mov [p_EnergyPref], al
+
+cpu_prepare_turbo:
+	xor eax, eax
+	cpuid
+	cmp ebx, 0x68747541		; 'Auth' of AuthenticAMD
+	je cpu_prepare_turbo_amd
+	cmp ebx, 0x756E6547		; 'Genu' of GenuineIntel
+	jne cpu_prepare_cstate
+	cmp esi, 6
+	jb cpu_prepare_cstate
+	mov eax, 6
+	cpuid
+	bt eax, 1			; Turbo Boost is available if bit 1 is set
+	jc cpu_prepare_turbo_intel
+	mov ecx, IA32_MISC_ENABLE
+	rdmsr
+	bt edx, 6			; Turbo Boost Disable (Bit 38) also clears the CPUID bit
+	jnc cpu_prepare_cstate
+cpu_prepare_turbo_intel:
+	or byte [p_PowerPolicy], POWER_TURBO_INTEL
+	jmp cpu_prepare_turbo_on
+cpu_prepare_turbo_amd:
+	mov eax, 0x80000000
+	cpuid
+	cmp eax, 0x80000007
+	jb cpu_prepare_cstate
+	mov eax, 0x80000007
+	cpuid
+	bt edx, 9			; Core Performance Boost is supported if bit 9 is set
+	jnc cpu_prepare_cstate
+	or byte [p_PowerPolicy], POWER_TURBO_AMD
+cpu_prepare_turbo_on:
+	cmp byte [cfg_turbo], 0
+	je cpu_prepare_cstate
+	or byte [p_PowerPolicy], POWER_TURBO_ON
+
+; The deepest MWAIT C-state up to cfg_cstate that CPUID leaf 5 lists
+cpu_prepare_cstate:
+	cmp byte [cfg_cstate], 0
+	je cpu_prepare_power_done	; The waiting AP's use HLT
+	mov eax, 1
+	cpuid
+	bt ecx, 3			; MONITOR/MWAIT is supported if bit 3 is set
+	jnc cpu_prepare_power_done
+	xor edx, edx			; Only C1 is known without leaf 5
+	cmp esi, 5
+	jb cpu_prepare_cstate_limit
+	mov eax, 5
+	cpuid
+	bt ecx, 0			; EDX lists the C-states if bit 0 is set
+	jc cpu_prepare_cstate_limit
+	xor edx, edx
+cpu_prepare_cstate_limit:
+	movzx ebx, byte [cfg_cstate]
+	cmp ebx, 7
+	jbe cpu_prepare_cstate_next
+	mov ebx, 7
+cpu_prepare_cstate_next:
+	xor eax, eax			; C1 is always there
+	cmp ebx, 1
+	je cpu_prepare_cstate_found
+	lea ecx, [rbx*4]
+	mov eax, edx
+	shr eax, cl
+	and eax, 0x0F			; Sub-states of C-state EBX
+	jnz cpu_prepare_cstate_sub
+	dec ebx
+	jmp cpu_prepare_cstate_next
+cpu_prepare_cstate_sub:
+	dec eax				; The deepest sub-state
+	lea ecx, [rbx-1]
+	shl ecx, 4			; Bits 7:4 are the C-state less one
+	or eax, ecx
+cpu_prepare_cstate_found:
+	mov [p_MWAITHint], al
+	or byte [p_PowerPolicy], POWER_CSTATE
+cpu_prepare_power_done:
+
+; CR4 features
+	cmp byte [cfg_cr4], 1
+	jne cpu_prepare_cr4_done
+	mov eax, 1
+	cpuid
+	bt edx, 13			; PGE is supported if bit 13 is set
+	jnc cpu_prepare_pcid
+	bts dword [p_CR4Features], 7	; Paging Global Extensions (Bit 7)
+cpu_prepare_pcid:
+	bt ecx, 17			; PCID is supported if bit 17 is set
+	jnc cpu_prepare_fsgsbase
+	bts dword [p_CR4Features], 17	; PCID Enable (Bit 17)
+cpu_prepare_fsgsbase:
+	cmp esi, 7
+	jb cpu_prepare_cr4_done
+	mov eax, 7
+	xor ecx, ecx
+	cpuid
+	bt ebx, 0			; FSGSBASE is supported if bit 0 is set
+	jnc cpu_prepare_cr4_done
+	bts dword [p_CR4Features], 16	; FSGSBASE Enable (Bit 16)
+cpu_prepare_cr4_done:
+
+; XSAVE state components
+	mov eax, 1
+	cpuid
+	bt ecx, 26			; XSAVE is supported if bit 26 is set
+	jnc cpu_prepare_done
+	cmp esi, 0x0D
+	jb cpu_prepare_done
+	mov eax, 0x0D
+	xor ecx, ecx
+	cpuid				; EDX:EAX holds the components XCR0 supports
+	shl rdx, 32
+	or rax, rdx
+	cmp byte [cfg_amx], 1
+	je cpu_prepare_amx
+	and rax, ~XCR0_AMX		; Leave out TILECFG and TILEDATA
+cpu_prepare_amx:
+	mov [p_XCR0], rax
+
+	mov rax, cr4
+	bts rax, 18			; Enable OSXSAVE (Bit 18)
+	mov cr4, rax
+	xor ecx, ecx			; XCR0
+	mov eax, [p_XCR0]
+	mov edx, [p_XCR0+4]
+	xsetbv
+	mov eax, 0x0D
+	xor ecx, ecx
+	cpuid				; EBX holds the XSAVE area size for the enabled components
+	mov [p_XSAVESize], ebx
+
+cpu_prepare_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; cpu_power -- Apply the power policy chosen by cpu_prepare to this core
+; Turbo is set first. HWP is then enabled with the lowest to highest
+; performance of this core, or up to its guaranteed performance with turbo
+; off, and a desired performance of 0 so the core picks within the range. The
+; energy-performance preference goes in the HWP request, or in the energy
+; performance bias without it. HWP stays enabled until a reset.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+cpu_power:
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	mov bl, [p_PowerPolicy]		; BL holds the POWER_* settings
+	test bl, POWER_TURBO_INTEL
+	jz cpu_power_turbo_amd
+	mov ecx, IA32_MISC_ENABLE
+	rdmsr
+	bts edx, 6			; Turbo Boost Disable (Bit 38)
+	test bl, POWER_TURBO_ON
+	jz cpu_power_turbo_write
+	btr edx, 6
+	jmp cpu_power_turbo_write
+cpu_power_turbo_amd:
+	test bl, POWER_TURBO_AMD
+	jz cpu_power_hwp
+	mov ecx, AMD_HWCR
+	rdmsr
+	bts eax, 25			; Core Performance Boost Disable (Bit 25)
+	test bl, POWER_TURBO_ON
+	jz cpu_power_turbo_write
+	btr eax, 25
+cpu_power_turbo_write:
+	wrmsr
+
+cpu_power_hwp:
+	test bl, POWER_HWP
+	jz cpu_power_epb
+	mov ecx, IA32_PM_ENABLE
+	mov eax, 1			; HWP Enable (Bit 0)
+	xor edx, edx
+	wrmsr
+	mov ecx, IA32_HWP_CAPABILITIES
+	rdmsr
+	mov ecx, eax
+	shr ecx, 24			; Minimum is the Lowest Performance (Bits 31:24)
+	mov ch, al			; Maximum is the Highest Performance (Bits 7:0)
+	test bl, POWER_TURBO_INTEL | POWER_TURBO_AMD
+	jz cpu_power_hwp_request
+	test bl, POWER_TURBO_ON
+	jnz cpu_power_hwp_request
+	mov ch, ah			; Or the Guaranteed Performance (Bits 15:8) with turbo off
+cpu_power_hwp_request:
+	movzx eax, cx
+	test bl, POWER_EPP
+	jz cpu_power_hwp_write
+	movzx ecx, byte [p_EnergyPref]
+	shl ecx, 24
+	or eax, ecx			; Energy Performance Preference (Bits 31:24)
+cpu_power_hwp_write:
+	xor edx, edx			; No activity window or package control
+	mov ecx, IA32_HWP_REQUEST
+	wrmsr
+	cmp word [p_cpu_activated], 0
+	jne cpu_power_epb
+	mov [p_HWPRequest], eax		; The BSP runs init_cpu before any AP is started
+
+cpu_power_epb:
+	test bl, POWER_EPB
+	jz cpu_power_done
+	mov ecx, IA32_ENERGY_PERF_BIAS
+	rdmsr
+	mov bl, [p_EnergyPref]
+	shr bl, 4			; The bias is 0 to 15
+	and al, 0xF0
+	or al, bl
+	wrmsr
+
+cpu_power_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; cpu_topology -- Write the topology and cache record of this CPU
+; The topology comes from CPUID leaf 0x1F or 0xB, or leaf 1 without them. The
+; caches come from CPUID leaf 0x8000001D on AMD and leaf 4 otherwise
+;  IN:	ECX = Index of this CPU in the CPU table
+; OUT:	Nothing, all registers preserved
+cpu_topology:
+	push rdi
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	push r8
+	push r9
+	push r10
+	push r11
+
+	mov edi, ecx
+	shl edi, 5
+	add edi, IM_CPU_TOPOLOGY	; RDI points to the 32-byte record
+	xor eax, eax
+	mov ecx, 4
+	rep stosq
+	sub edi, 32
+
+	xor eax, eax
+	cpuid
+	mov r8d, eax			; R8D holds the highest standard CPUID leaf
+	mov eax, 1
+	cpuid
+	mov eax, ebx
+	shr eax, 24			; Initial APIC ID
+	mov [rdi+TOPO_APICID], eax
+	bt edx, 28			; More than one logical processor per package if bit 28 is set
+	jnc cpu_topology_leaf
+	mov eax, ebx
+	shr eax, 16
+	and eax, 0xFF			; Addressable logical processor IDs per package
+	call cpu_topology_shift
+	mov [rdi+TOPO_DIE_SHIFT], al
+	mov [rdi+TOPO_PKG_SHIFT], al
+
+; Extended topology, preferring V2 which also lists dies
+cpu_topology_leaf:
+	mov r10d, 0x1F
+	cmp r8d, r10d
+	jb cpu_topology_leaf_b
+	mov eax, r10d
+	xor ecx, ecx
+	cpuid
+	test ebx, 0xFFFF
+	jnz cpu_topology_levels
+cpu_topology_leaf_b:
+	mov r10d, 0x0B
+	cmp r8d, r10d
+	jb cpu_topology_type
+	mov eax, r10d
+	xor ecx, ecx
+	cpuid
+	test ebx, 0xFFFF		; Logical processors at this level
+	jz cpu_topology_type
+cpu_topology_levels:
+	mov [rdi+TOPO_APICID], edx	; x2APIC ID
+	mov byte [rdi+TOPO_DIE_SHIFT], 0xFF
+	xor r9d, r9d			; Sub-leaf
+	xor r11d, r11d			; Shift of the level below
+cpu_topology_level:
+	mov eax, r10d
+	mov ecx, r9d
+	cpuid
+	movzx esi, ch			; Level type
+	cmp esi, 0
+	je cpu_topology_levels_done
+	and eax, 0x1F			; Shift to the ID of the next level
+	cmp esi, 1			; SMT
+	jne cpu_topology_level_die
+	mov [rdi+TOPO_SMT_SHIFT], al
+cpu_topology_level_die:
+	cmp esi, 5			; Die
+	jne cpu_topology_level_next
+	mov [rdi+TOPO_DIE_SHIFT], r11b
+cpu_topology_level_next:
+	mov r11d, eax
+	mov [rdi+TOPO_PKG_SHIFT], al	; The last level gives the package shift
+	inc r9d
+	cmp r9d, 8
+	jb cpu_topology_level
+cpu_topology_levels_done:
+	cmp byte [rdi+TOPO_DIE_SHIFT], 0xFF
+	jne cpu_topology_type
+	mov al, [rdi+TOPO_PKG_SHIFT]	; No die level, each package is one die
+	mov [rdi+TOPO_DIE_SHIFT], al
+
+; Hybrid core type
+cpu_topology_type:
+	cmp r8d, 0x1A
+	jb cpu_topology_cache
+	mov eax, 0x1A
+	xor ecx, ecx
+	cpuid
+	shr eax, 24			; 0x20 Atom, 0x40 Core
+	mov [rdi+TOPO_CORE_TYPE], al
+
+; Deterministic cache parameters
+cpu_topology_cache:
+	mov r10d, 4
+	mov eax, 0x80000000
+	cpuid
+	cmp eax, 0x8000001D
+	jb cpu_topology_cache_std
+	mov eax, 0x80000001
+	cpuid
+	bt ecx, 22			; AMD topology extensions are supported if bit 22 is set
+	jnc cpu_topology_cache_std
+	mov r10d, 0x8000001D
+	jmp cpu_topology_cache_start
+cpu_topology_cache_std:
+	cmp r8d, r10d
+	jb cpu_topology_done
+cpu_topology_cache_start:
+	xor r9d, r9d			; Sub-leaf
+cpu_topology_cache_next:
+	mov eax, r10d
+	mov ecx, r9d
+	cpuid
+	mov r8d, eax
+	and eax, 0x1F			; Cache type, 1 data, 2 instruction, 3 unified
+	jz cpu_topology_done
+	mov esi, eax
+	mov eax, ebx
+	shr eax, 22
+	inc eax				; Ways
+	mov edx, ebx
+	shr edx, 12
+	and edx, 0x3FF
+	inc edx				; Partitions
+	imul eax, edx
+	inc ecx				; Sets
+	imul rax, rcx
+	and ebx, 0xFFF
+	inc ebx				; Line size
+	imul rax, rbx
+	mov r11, rax			; R11 = size of the cache in bytes
+	mov eax, r8d
+	shr eax, 14
+	and eax, 0xFFF
+	inc eax				; Addressable logical processor IDs sharing it
+	call cpu_topology_shift
+	mov edx, r8d
+	shr edx, 5
+	and edx, 7			; Level
+	cmp edx, 1
+	jne cpu_topology_cache_l2
+	cmp esi, 2
+	je cpu_topology_cache_l1i
+	mov [rdi+TOPO_L1D_SIZE], r11d
+	mov [rdi+TOPO_LINE_SIZE], bl
+	jmp cpu_topology_cache_skip
+cpu_topology_cache_l1i:
+	mov [rdi+TOPO_L1I_SIZE], r11d
+	jmp cpu_topology_cache_skip
+cpu_topology_cache_l2:
+	cmp esi, 2
+	je cpu_topology_cache_skip	; Only level 1 instruction caches are listed
+	cmp edx, 2
+	jne cpu_topology_cache_llc
+	mov [rdi+TOPO_L2_SIZE], r11d
+	mov [rdi+TOPO_L2_SHIFT], al
+cpu_topology_cache_llc:
+	cmp dl, [rdi+TOPO_LLC_LEVEL]
+	jb cpu_topology_cache_skip
+	mov [rdi+TOPO_LLC_LEVEL], dl
+	mov [rdi+TOPO_LLC_SIZE], r11d
+	mov [rdi+TOPO_LLC_SHIFT], al
+cpu_topology_cache_skip:
+	inc r9d
+	cmp r9d, 16
+	jb cpu_topology_cache_next
+
+cpu_topology_done:
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	pop rdi
+	ret
+
+; Number of APIC ID bits needed to count to a number of IDs
+; IN:	EAX = Number of IDs
+; OUT:	EAX = Bits
+cpu_topology_shift:
+	cmp eax, 1
+	jbe cpu_topology_shift_zero
+	dec eax
+	bsr eax, eax
+	inc eax
+	ret
+cpu_topology_shift_zero:
+	xor eax, eax
+	ret
 ; -----------------------------------------------------------------------------
 
 
+XCR0_AMX	equ 0x60000		; TILECFG (Bit 17) and TILEDATA (Bit 18)
+
+
+; Power policy settings in p_PowerPolicy
+POWER_HWP		equ 0x01	; HWP enabled and IA32_HWP_REQUEST written
+POWER_EPP		equ 0x02	; The preference is in IA32_HWP_REQUEST
+POWER_EPB		equ 0x04	; The preference is in IA32_ENERGY_PERF_BIAS
+POWER_TURBO_INTEL	equ 0x08	; Turbo set with IA32_MISC_ENABLE
+POWER_TURBO_AMD		equ 0x10	; Turbo set with the AMD HWCR
+POWER_TURBO_ON		equ 0x20	; Turbo enabled, otherwise disabled
+POWER_CSTATE		equ 0x40	; The waiting AP's use MWAIT with p_MWAITHint
+
+; Power MSRs
+IA32_MISC_ENABLE	equ 0x000001A0
+IA32_ENERGY_PERF_BIAS	equ 0x000001B0
+IA32_PM_ENABLE		equ 0x00000770
+IA32_HWP_CAPABILITIES	equ 0x00000771
+IA32_HWP_REQUEST	equ 0x00000774
+AMD_HWCR		equ 0xC0010015
+
+
+; Topology record
+TOPO_APICID	equ 0x00		; DD - APIC ID, or x2APIC ID from the extended topology leaf
+TOPO_SMT_SHIFT	equ 0x04		; DB - APIC ID bits for the thread within a core
+TOPO_DIE_SHIFT	equ 0x05		; DB - APIC ID bits below the die ID
+TOPO_PKG_SHIFT	equ 0x06		; DB - APIC ID bits below the package ID
+TOPO_CORE_TYPE	equ 0x07		; DB - Hybrid core type from CPUID leaf 0x1A, 0 if not listed
+TOPO_L2_SHIFT	equ 0x08		; DB - APIC ID bits below the ID shared by an L2 cache
+TOPO_LLC_SHIFT	equ 0x09		; DB - APIC ID bits below the ID shared by the last level cache
+TOPO_LLC_LEVEL	equ 0x0A		; DB - Level of the last level cache
+TOPO_LINE_SIZE	equ 0x0B		; DB - L1 data cache line size in bytes
+TOPO_L1D_SIZE	equ 0x0C		; DD - Sizes in bytes
+TOPO_L1I_SIZE	equ 0x10		; DD
+TOPO_L2_SIZE	equ 0x14		; DD
+TOPO_LLC_SIZE	equ 0x18		; DD
+
+
 ; Register list
 ; 0x000 - 0x010 are Reserved
 APIC_ID		equ 0x020		; ID Register
@@ -0,0 +1,1258 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; INIT MEM - Build the page tables, set the MTRRs, and set the memory types of
+; the MMIO ranges in the identity map. This code is called by the BSP
+; =============================================================================
+
+
+init_mem:
+; MTRR values for all cores
+	call mtrr_prepare
+
+; Local APIC
+	mov rax, [p_LocalAPICAddress]
+	mov ecx, 4096
+	mov edx, PAGE_UC
+	call mem_set_type
+
+; HPET
+	mov rax, [p_HPETAddress]
+	cmp rax, 0
+	je init_mem_hpet_done
+	mov ecx, 1024
+	call mem_set_type
+init_mem_hpet_done:
+
+; I/O APICs
+	mov rsi, IM_IOAPICAddress
+	xor ebx, ebx
+	mov bl, [p_IOAPICCount]
+init_mem_ioapic:
+	cmp ebx, 0
+	je init_mem_ioapic_done
+	mov eax, [rsi+4]		; I/O APIC Address
+	mov ecx, 4096
+	call mem_set_type
+	add rsi, 16
+	dec ebx
+	jmp init_mem_ioapic
+init_mem_ioapic_done:
+
+; PCIe ECAM ranges
+	mov rsi, IM_PCIE
+	xor ebx, ebx
+	mov bx, [p_PCIECount]
+init_mem_pcie:
+	cmp ebx, 0
+	je init_mem_pcie_done
+	mov rax, [rsi]			; Base address of enhanced configuration mechanism
+	xor ecx, ecx
+	mov cl, [rsi+11]		; End PCI bus number
+	sub cl, [rsi+10]		; Start PCI bus number
+	inc ecx
+	shl ecx, 20			; Each bus uses 1MiB of configuration space
+	call mem_set_type
+	add rsi, 16
+	dec ebx
+	jmp init_mem_pcie
+init_mem_pcie_done:
+
+; Frame buffer
+	mov eax, [VBEModeInfoBlock.PhysBasePtr]
+	cmp eax, 0
+	je init_mem_fb_done		; No graphics mode was set
+	xor ecx, ecx
+	mov cx, [VBEModeInfoBlock.BytesPerScanLine]
+	xor edx, edx
+	mov dx, [VBEModeInfoBlock.YResolution]
+	imul ecx, edx			; Lines can be longer than the visible pixels
+	mov edx, PAGE_WC
+	call mem_set_type
+init_mem_fb_done:
+
+	ret
+
+
+; -----------------------------------------------------------------------------
+; mem_extents -- Build the list of free memory from the E820 memory map
+;		 Extents are 2MiB aligned, sorted, and merged if they overlap
+;		 or touch. The first 2MiB page holds Pure64 and the payload
+;  IN:	Nothing
+; OUT:	IM_MEMEXTENTS and p_MemExtents are set
+;	All other registers except RSP may be modified
+mem_extents:
+	mov esi, 0x00006000		; E820 Map location
+	mov edi, IM_MEMEXTENTS
+	xor ecx, ecx			; Number of extents
+mem_extents_e820:
+	mov eax, [rsi+16]		; Type
+	cmp eax, 0			; End of the list?
+	je mem_extents_sort
+	cmp eax, 1			; Is it marked as free?
+	jne mem_extents_e820_next
+	cmp ecx, IM_MEMEXTENTS_MAX
+	jae mem_extents_e820_next
+	mov rax, [rsi]			; Physical start address
+	mov rdx, [rsi+8]		; Physical length
+	add rdx, rax
+	add rax, 0x1FFFFF		; Round the start up to a 2MiB page
+	and rax, -0x200000
+	and rdx, -0x200000		; Round the end down to a 2MiB page
+	cmp rax, 0x200000
+	jae mem_extents_e820_start
+	mov eax, 0x200000
+mem_extents_e820_start:
+	sub rdx, rax			; Do we have at least 1 page?
+	jbe mem_extents_e820_next
+	mov [rdi], rax
+	mov [rdi+8], rdx
+	add edi, 32
+	inc ecx
+mem_extents_e820_next:
+	add esi, 32
+	jmp mem_extents_e820
+
+; Insertion sort by base address
+mem_extents_sort:
+	mov r8d, 1
+mem_extents_sort_next:
+	cmp r8d, ecx
+	jae mem_extents_merge
+	mov rdi, r8
+	shl rdi, 5
+	add rdi, IM_MEMEXTENTS
+	mov rax, [rdi]			; Extent to insert
+	mov rdx, [rdi+8]
+mem_extents_sort_shift:
+	cmp rdi, IM_MEMEXTENTS
+	je mem_extents_sort_insert
+	cmp [rdi-32], rax
+	jbe mem_extents_sort_insert
+	mov r9, [rdi-32]
+	mov [rdi], r9
+	mov r9, [rdi-32+8]
+	mov [rdi+8], r9
+	sub rdi, 32
+	jmp mem_extents_sort_shift
+mem_extents_sort_insert:
+	mov [rdi], rax
+	mov [rdi+8], rdx
+	inc r8d
+	jmp mem_extents_sort_next
+
+; Merge extents that overlap or touch
+mem_extents_merge:
+	mov esi, IM_MEMEXTENTS		; Next extent to read
+	mov edi, IM_MEMEXTENTS		; Last extent written
+	cmp ecx, 0
+	je mem_extents_done
+	dec ecx
+mem_extents_merge_next:
+	mov rax, [rdi]
+	add rax, [rdi+8]		; RAX is the end of the last extent written
+	cmp ecx, 0
+	je mem_extents_merged
+	add esi, 32
+	dec ecx
+	mov rdx, [rsi]
+	cmp rdx, rax			; Does it start past the end of the last one?
+	ja mem_extents_merge_new
+	add rdx, [rsi+8]
+	cmp rdx, rax
+	jbe mem_extents_merge_next
+	sub rdx, [rdi]
+	mov [rdi+8], rdx
+	jmp mem_extents_merge_next
+mem_extents_merge_new:
+	add edi, 32
+	mov [rdi], rdx
+	mov rdx, [rsi+8]
+	mov [rdi+8], rdx
+	jmp mem_extents_merge_next
+mem_extents_merged:
+	add edi, 32
+
+mem_extents_done:
+	xor eax, eax			; Create a blank record for termination (32 bytes)
+	mov ecx, 4
+	push rdi
+	rep stosq
+	pop rax
+	sub eax, IM_MEMEXTENTS
+	shr eax, 5
+	mov [p_MemExtents], ax
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mem_reserve -- Remove a range from a sorted list of 32-byte memory ranges
+; An entry that holds the whole range is split in two, the second half getting
+; a copy of the other fields. The list keeps its blank record at the end
+;  IN:	RAX = Start of the range
+;	RDX = End of the range
+;	RSI = Address of the list
+;	RDI = Address of the 16-bit entry count
+;	ECX = Maximum number of entries
+; OUT:	Nothing, all registers preserved
+mem_reserve:
+	push rsi
+	push rdi
+	push rcx
+	push rbx
+	push r8
+	push r9
+	push r10
+	push r11
+
+	mov r11d, ecx			; R11 = maximum number of entries
+	mov rbx, rsi			; RBX = current entry
+	movzx ecx, word [rdi]		; RCX = entries left to check
+mem_reserve_next:
+	test ecx, ecx
+	jz mem_reserve_done
+	mov r8, [rbx]			; Start of the entry
+	mov r9, [rbx+8]
+	add r9, r8			; End of the entry
+	cmp r8, rdx
+	jae mem_reserve_done		; The list is sorted, no others can overlap
+	cmp r9, rax
+	jbe mem_reserve_skip		; Ends before the range
+	cmp r8, rax
+	jb mem_reserve_low		; Part of it is below the range
+	cmp r9, rdx
+	ja mem_reserve_high		; Part of it is above the range
+
+	; The whole entry is inside the range so remove it
+	push rsi
+	push rdi
+	push rcx
+	lea rsi, [rbx+32]
+	mov rdi, rbx
+	shl ecx, 2			; Entries after it and the blank record, in qwords
+	rep movsq
+	pop rcx
+	pop rdi
+	pop rsi
+	dec word [rdi]
+	dec ecx
+	jmp mem_reserve_next
+
+mem_reserve_high:			; Keep the part above the range
+	mov [rbx], rdx
+	sub r9, rdx
+	mov [rbx+8], r9
+	jmp mem_reserve_done
+
+mem_reserve_low:			; Keep the part below the range
+	mov r10, rax
+	sub r10, r8
+	mov [rbx+8], r10
+	cmp r9, rdx
+	jbe mem_reserve_skip
+	movzx r10d, word [rdi]		; The entry also goes past the range
+	cmp r10d, r11d
+	jae mem_reserve_done		; No room to split it, the part above is lost
+	inc word [rdi]
+	push rsi
+	push rdi
+	push rcx
+	shl ecx, 5
+	lea rsi, [rbx+rcx+32-8]		; Last qword of the blank record
+	lea rdi, [rsi+32]
+	shr ecx, 3			; Entries after it and the blank record, in qwords
+	std
+	rep movsq			; Move them up by one entry
+	cld
+	pop rcx
+	pop rdi
+	pop rsi
+	mov [rbx+32], rdx		; The new entry holds the part above the range
+	sub r9, rdx
+	mov [rbx+32+8], r9
+	mov r10, [rbx+16]
+	mov [rbx+32+16], r10
+	mov r10, [rbx+24]
+	mov [rbx+32+24], r10
+	jmp mem_reserve_done
+
+mem_reserve_skip:
+	add rbx, 32
+	dec ecx
+	jmp mem_reserve_next
+
+mem_reserve_done:
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rbx
+	pop rcx
+	pop rdi
+	pop rsi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mem_map -- Extend the identity map past 4GiB and build the higher half map
+;	     The higher half maps all free memory extents one after the other.
+;	     1GiB pages are used when supported, 2MiB pages only around holes
+;  IN:	Nothing
+; OUT:	EBX = Number of 2MiB pages in the higher half map
+;	All other registers except RSP may be modified
+mem_map:
+	mov r14, 0x20000		; Next free page table
+	mov qword [p_PageTableEnd], IM_CPU_TOPOLOGY	; The topology table follows the page tables
+	xor r15d, r15d
+	mov eax, 0x80000001
+	cpuid
+	bt edx, 26			; 1GiB pages are supported if bit 26 is set
+	jnc mem_map_tables
+	inc r15d
+
+; Identity map from 4GiB to the end of RAM with 1GiB pages
+; The first 4GiB keep their 2MiB pages so MMIO ranges can be typed
+	xor ecx, ecx
+	mov cx, [p_MemExtents]
+	cmp ecx, 0
+	je mem_map_high
+	shl ecx, 5
+	add rcx, IM_MEMEXTENTS-32	; Last extent
+	mov rax, [rcx]
+	add rax, [rcx+8]
+	add rax, 0x3FFFFFFF
+	shr rax, 30
+	mov rcx, rax			; RCX is the number of GiB to identity map
+	mov r11d, 4			; Next GiB to map
+	mov edi, 0x00003000 + 4*8	; PDPTE for the 5th GiB
+mem_map_identity:
+	cmp r11, rcx
+	jae mem_map_high
+	test r11d, 511			; A new PDP is needed every 512GiB
+	jnz mem_map_identity_entry
+	mov rax, r11
+	shr rax, 9
+	cmp rax, 256			; Stay in the lower half
+	jae mem_map_high
+	call mem_alloc_table
+	jc mem_map_high
+	lea rdx, [rdi+7]		; Bits 0 (P), 1 (R/W), 2 (U/S)
+	mov [0x2000+rax*8], rdx
+mem_map_identity_entry:
+	mov rax, r11
+	shl rax, 30
+	or rax, 0x187			; Bits 0 (P), 1 (R/W), 2 (U/S), 7 (PS), and 8 (G) set
+	stosq
+	inc r11
+	jmp mem_map_identity
+
+; Without 1GiB pages the higher half needs a PD for every GiB. If they do not
+; all fit below the topology table they are taken from free memory instead
+mem_map_tables:
+	xor eax, eax
+	mov esi, IM_MEMEXTENTS
+mem_map_tables_sum:
+	cmp qword [rsi+8], 0		; End of the list?
+	je mem_map_tables_count
+	add rax, [rsi+8]
+	add esi, 32
+	jmp mem_map_tables_sum
+mem_map_tables_count:
+	add rax, 0x3FFFFFFF
+	shr rax, 30			; RAX is the number of PDs needed
+	mov rcx, rax
+	shr rcx, 9
+	add rax, rcx			; Plus a PDP for every 512GiB
+	cmp rax, (IM_CPU_TOPOLOGY - 0x20000) / 4096
+	jbe mem_map_high
+	shl rax, 12
+	add rax, 0x1FFFFF
+	and rax, -0x200000
+	mov rcx, rax			; RCX is the size of the tables in 2MiB blocks
+	push rcx
+	mov r13, 0x100000000		; The identity map always covers the first 4GiB
+	mov r15d, 0xFFFFFFFF		; From any proximity domain
+	call init_percpu_alloc
+	pop rcx
+	mov r15d, 0			; Keep the carry, 1GiB pages are not used
+	jc mem_map_high			; No room, the map ends when the tables run out
+	mov r14, rax
+	add rax, rcx
+	mov [p_PageTableEnd], rax
+
+; Higher half map. The 1GiB aligned part of an extent is mapped with 1GiB pages
+; once the higher half is also at a GiB boundary. The 2MiB pages before it that
+; do not fit are queued and mapped after it instead
+mem_map_high:
+	xor r12, r12			; Number of 2MiB pages in the higher half map
+	xor r13, r13			; Number of queued 2MiB pages
+	mov r9, 0x4000			; PDP for the current 512GiB of the higher half
+	mov esi, IM_MEMEXTENTS		; Extent of the first queued page
+	mov rbp, [rsi]
+	shr rbp, 21			; First queued page
+	mov ebx, IM_MEMEXTENTS
+mem_map_high_extent:
+	cmp qword [rbx+8], 0		; End of the list?
+	je mem_map_high_rest
+	mov rax, [rbx]
+	add rax, [rbx+8]
+	mov [rbx+16], rax		; No part is mapped with 1GiB pages yet
+	mov [rbx+24], rax
+	cmp r15d, 0
+	je mem_map_high_small
+	mov r8, [rbx]
+	shr r8, 21
+	add r8, 511
+	and r8, -512			; R8 is the first 1GiB aligned page
+	mov r11, [rbx]
+	add r11, [rbx+8]
+	shr r11, 21
+	and r11, -512			; R11 is the last 1GiB aligned page
+	cmp r8, r11
+	jae mem_map_high_small
+	add r13, r8			; Queue the pages before the 1GiB aligned part
+	mov rax, [rbx]
+	shr rax, 21
+	sub r13, rax
+mem_map_high_align:
+	mov rcx, r12
+	neg rcx
+	and ecx, 511			; RCX is the number of 2MiB pages to the next GiB
+	cmp r13, rcx
+	jae mem_map_high_flush
+	add r13, 512			; Not enough, this GiB is queued as 2MiB pages
+	add r8, 512
+	cmp r8, r11
+	jb mem_map_high_align
+	jmp mem_map_high_tail
+mem_map_high_flush:
+	mov rax, r13
+	sub rax, rcx
+	and rax, -512
+	add rcx, rax			; Map as many as possible while ending on a GiB
+	sub r13, rcx
+	call mem_map_small
+	jc mem_map_high_done
+	mov rax, r8
+	shl rax, 21
+	mov [rbx+16], rax		; Start of the part mapped with 1GiB pages
+	mov rax, r11
+	shl rax, 21
+	mov [rbx+24], rax		; End of the part mapped with 1GiB pages
+mem_map_high_gib:
+	cmp r8, r11
+	jae mem_map_high_tail
+	call mem_high_pdpte
+	jc mem_map_high_done
+	mov rax, r8
+	shl rax, 21
+	or rax, 0x187			; Bits 0 (P), 1 (R/W), 2 (U/S), 7 (PS), and 8 (G) set
+	mov [rdi], rax
+	add r12, 512
+	add r8, 512
+	jmp mem_map_high_gib
+mem_map_high_tail:
+	mov rax, [rbx]			; Queue the pages after the 1GiB aligned part
+	add rax, [rbx+8]
+	shr rax, 21
+	sub rax, r11
+	add r13, rax
+	jmp mem_map_high_next
+mem_map_high_small:
+	mov rax, [rbx+8]		; Queue the whole extent
+	shr rax, 21
+	add r13, rax
+mem_map_high_next:
+	add ebx, 32
+	jmp mem_map_high_extent
+
+mem_map_high_rest:
+	mov rcx, r13			; Map all queued pages
+	call mem_map_small
+
+mem_map_high_done:
+	mov rbx, r12
+	ret
+
+; Map the next RCX queued pages, starting at page RBP of extent RSI, with 2MiB
+; pages. Pages in the part of an extent mapped with 1GiB pages are skipped
+mem_map_small:
+	cmp rcx, 0
+	je mem_map_small_done
+	cmp qword [rsi+8], 0		; End of the list?
+	je mem_map_small_done
+	mov rax, [rsi+16]
+	shr rax, 21
+	cmp rbp, rax
+	jb mem_map_small_end
+	mov rax, [rsi+24]
+	shr rax, 21
+	cmp rbp, rax
+	jae mem_map_small_end
+	mov rbp, rax			; Skip the part mapped with 1GiB pages
+mem_map_small_end:
+	mov rax, [rsi]
+	add rax, [rsi+8]
+	shr rax, 21
+	cmp rbp, rax			; Past the end of this extent?
+	jb mem_map_small_page
+	add esi, 32
+	mov rbp, [rsi]
+	shr rbp, 21
+	jmp mem_map_small
+mem_map_small_page:
+	test r12d, 511			; A new PD is needed every GiB
+	jnz mem_map_small_entry
+	call mem_high_pdpte
+	jc mem_map_small_full
+	mov rax, rdi
+	call mem_alloc_table
+	jc mem_map_small_full
+	mov r10, rdi			; PD for the current GiB of the higher half
+	or rdi, 7			; Bits 0 (P), 1 (R/W), 2 (U/S)
+	mov [rax], rdi
+mem_map_small_entry:
+	mov rdx, rbp
+	shl rdx, 21
+	or rdx, 0x187			; Bits 0 (P), 1 (R/W), 2 (U/S), 7 (PS), and 8 (G) set
+	mov edi, r12d
+	and edi, 511
+	mov [r10+rdi*8], rdx
+	inc r12
+	inc rbp
+	dec rcx
+	jmp mem_map_small
+mem_map_small_done:
+	clc
+	ret
+mem_map_small_full:
+	stc
+	ret
+
+; Return the address of the PDPTE for the higher half at R12 in RDI
+mem_high_pdpte:
+	push rax
+	mov rax, r12
+	shr rax, 9			; GiB of the higher half
+	test eax, 511			; A new PDP is needed every 512GiB
+	jnz mem_high_pdpte_found
+	cmp rax, 0
+	je mem_high_pdpte_found
+	push rax
+	shr rax, 9
+	cmp rax, 256			; PML4 entries 256 to 511
+	jae mem_high_pdpte_full
+	call mem_alloc_table
+	jc mem_high_pdpte_full
+	mov r9, rdi
+	or rdi, 7			; Bits 0 (P), 1 (R/W), 2 (U/S)
+	mov [0x2800+rax*8], rdi
+	pop rax
+mem_high_pdpte_found:
+	and eax, 511
+	lea rdi, [r9+rax*8]
+	pop rax
+	clc
+	ret
+mem_high_pdpte_full:
+	pop rax
+	pop rax
+	stc
+	ret
+
+; Return a cleared page table in RDI, Carry set if there are none left
+mem_alloc_table:
+	cmp r14, [p_PageTableEnd]
+	jae mem_alloc_table_full
+	push rax
+	push rcx
+	mov rdi, r14
+	xor eax, eax
+	mov ecx, 512
+	rep stosq
+	mov rdi, r14
+	add r14, 4096
+	pop rcx
+	pop rax
+	clc
+	ret
+mem_alloc_table_full:
+	stc
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mem_set_type -- Set the memory type for the 2MiB identity mapped pages that
+;		  cover a range. Only the first 4GiB are changed.
+;  IN:	RAX = Start address
+;	RCX = Length in bytes
+;	EDX = Memory type bits (PAGE_WB, PAGE_UC, or PAGE_WC)
+; OUT:	All registers preserved
+mem_set_type:
+	push rcx
+	push rax
+
+	add rcx, rax			; RCX is the end address
+	shr rax, 21			; RAX is the first 2MiB page
+	add rcx, 0x1FFFFF
+	shr rcx, 21			; RCX is the 2MiB page after the range
+	cmp rcx, 2048			; Stop at the end of the low PD
+	jbe mem_set_type_next
+	mov ecx, 2048
+mem_set_type_next:
+	cmp rax, rcx
+	jae mem_set_type_done
+	and qword [0x10000+rax*8], PAGE_TYPE_MASK
+	or qword [0x10000+rax*8], rdx
+	inc rax
+	jmp mem_set_type_next
+
+mem_set_type_done:
+	pop rax
+	pop rcx
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mtrr_prepare -- Decide on the MTRR values that every core will load
+;  IN:	Nothing
+; OUT:	MTRRState and p_MTRRMode are set
+;	All other registers may be modified
+mtrr_prepare:
+	mov eax, 1
+	cpuid
+	bt edx, 12			; MTRRs are supported if bit 12 is set
+	jnc mtrr_prepare_done
+
+	call mtrr_save			; Start with a copy of the BSP firmware values
+	mov byte [p_MTRRMode], 1
+	cmp byte [cfg_mtrr], 1		; Build them from the memory map instead?
+	je mtrr_prepare_build
+	bt dword [MTRRState], 11	; Did the firmware enable the MTRRs?
+	jc mtrr_prepare_done
+
+mtrr_prepare_build:
+	call mtrr_build
+	jc mtrr_prepare_fallback
+	mov byte [p_MTRRMode], 2
+	jmp mtrr_prepare_done
+
+mtrr_prepare_fallback:
+	call mtrr_save			; Not enough variable MTRRs, go back to the firmware values
+
+mtrr_prepare_done:
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mtrr_save -- Copy the MTRRs of this core to MTRRState
+;  IN:	Nothing
+; OUT:	All registers except RSP may be modified
+mtrr_save:
+	mov rdi, MTRRState
+	mov ecx, 0x000002FF		; IA32_MTRR_DEF_TYPE
+	call mtrr_save_msr
+
+	mov ecx, 0x000000FE		; IA32_MTRRCAP
+	rdmsr
+	mov ebx, eax
+	mov rsi, mtrr_fixed_msrs
+	mov r8d, MTRR_FIXED_COUNT
+mtrr_save_fixed:
+	movzx ecx, word [rsi]
+	add rsi, 2
+	xor eax, eax
+	xor edx, edx
+	bt ebx, 8			; Fixed range MTRRs are supported if bit 8 is set
+	jnc mtrr_save_fixed_store
+	rdmsr
+mtrr_save_fixed_store:
+	stosd
+	mov eax, edx
+	stosd
+	dec r8d
+	jnz mtrr_save_fixed
+
+	movzx eax, bl			; Number of variable range MTRRs (Bits 7:0)
+	cmp eax, MTRR_VAR_MAX
+	jbe mtrr_save_count
+	mov eax, MTRR_VAR_MAX
+mtrr_save_count:
+	stosq
+	mov r8d, eax
+	mov ecx, 0x00000200		; IA32_MTRR_PHYSBASE0
+mtrr_save_var:
+	cmp r8d, 0
+	je mtrr_save_done
+	call mtrr_save_msr		; IA32_MTRR_PHYSBASEn
+	inc ecx
+	call mtrr_save_msr		; IA32_MTRR_PHYSMASKn
+	inc ecx
+	dec r8d
+	jmp mtrr_save_var
+
+mtrr_save_done:
+	ret
+
+mtrr_save_msr:
+	rdmsr
+	stosd
+	mov eax, edx
+	stosd
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mtrr_build -- Build the MTRR values from the E820 memory map
+;		RAM is WB and every hole in it UC, the default type is UC
+;  IN:	Nothing
+; OUT:	MTRRState is set, Carry set if there are not enough variable MTRRs
+;	All other registers except RSP may be modified
+mtrr_build:
+; Mask of the valid physical address bits
+	mov eax, 0x80000000
+	cpuid
+	mov ecx, 36			; Default physical address width
+	cmp eax, 0x80000008
+	jb mtrr_build_physmask
+	mov eax, 0x80000008
+	cpuid
+	movzx ecx, al			; Physical address width (Bits 7:0)
+mtrr_build_physmask:
+	mov r9d, 1
+	shl r9, cl
+	dec r9
+	and r9, -4096			; R9 is the mask for the address bits 12 and up
+
+; Find the end of all RAM (R11). Only usable and ACPI reclaimable memory is RAM
+	xor r11, r11
+	mov esi, 0x00006000		; E820 Map location
+mtrr_build_e820:
+	mov eax, [rsi+16]		; Type
+	cmp eax, 0			; End of the list?
+	je mtrr_build_e820_end
+	call mtrr_build_ram
+	jne mtrr_build_e820_next
+	mov rax, [rsi]			; Physical start address
+	add rax, [rsi+8]		; Physical length
+	cmp rax, r11
+	jbe mtrr_build_e820_next
+	mov r11, rax
+mtrr_build_e820_next:
+	add esi, 32
+	jmp mtrr_build_e820
+
+mtrr_build_e820_end:
+	add r11, 0x1FFFFF		; Round up to a 2MiB page
+	and r11, -0x200000
+	cmp r11, 0			; No RAM found in the memory map?
+	je mtrr_build_fail
+
+; Default type UC, MTRRs enabled, fixed range MTRRs enabled if supported
+	mov ecx, 0x000000FE		; IA32_MTRRCAP
+	rdmsr
+	movzx r12d, al			; Number of variable range MTRRs (Bits 7:0)
+	cmp r12d, MTRR_VAR_MAX
+	jbe mtrr_build_deftype
+	mov r12d, MTRR_VAR_MAX
+mtrr_build_deftype:
+	mov rdi, MTRRState
+	mov ebx, 0x00000800		; MTRR Enable (Bit 11), default type UC
+	bt eax, 8
+	jnc mtrr_build_fixed
+	bts ebx, 10			; Fixed Range MTRR Enable (Bit 10)
+mtrr_build_fixed:
+	mov eax, ebx
+	stosq
+
+; Fixed ranges 0-0x9FFFF are WB, 0xA0000-0xBFFFF (video) UC, 0xC0000-0xFFFFF (ROM) WP
+	mov rax, 0x0606060606060606
+	stosq				; IA32_MTRR_FIX64K_00000
+	stosq				; IA32_MTRR_FIX16K_80000
+	xor eax, eax
+	stosq				; IA32_MTRR_FIX16K_A0000
+	mov rax, 0x0505050505050505
+	mov ecx, 8
+	rep stosq			; IA32_MTRR_FIX4K_C0000 - IA32_MTRR_FIX4K_F8000
+
+; Variable ranges, WB from 0 to the end of RAM and UC for every hole in it
+	mov qword [MTRRState+MTRR_STATE_COUNT], 0
+	xor eax, eax
+	mov rbx, r11
+	mov r8d, 6			; WB
+	call mtrr_build_range
+	jc mtrr_build_done
+	mov r10d, 0x00100000		; R10 is the end of the RAM so far, the fixed ranges cover 1MiB
+mtrr_build_hole:
+	cmp r10, r11
+	jae mtrr_build_done		; Carry is clear
+	mov r14, r11			; R14 is the start of the next RAM after R10
+	mov esi, 0x00006000
+mtrr_build_hole_e820:
+	cmp dword [rsi+16], 0		; End of the list?
+	je mtrr_build_hole_found
+	mov eax, [rsi+16]
+	call mtrr_build_ram
+	jne mtrr_build_hole_next
+	mov rax, [rsi]
+	mov r15, rax
+	add r15, [rsi+8]		; R15 is the end of the entry
+	cmp rax, r10
+	ja mtrr_build_hole_after
+	cmp r15, r10
+	jbe mtrr_build_hole_next
+	mov r10, r15			; The entry continues the RAM, start again after it
+	jmp mtrr_build_hole
+mtrr_build_hole_after:
+	cmp rax, r14
+	jae mtrr_build_hole_next
+	mov r14, rax
+mtrr_build_hole_next:
+	add esi, 32
+	jmp mtrr_build_hole_e820
+mtrr_build_hole_found:
+	mov rax, r10			; The hole is R10 to R14, rounded out to 4KiB pages
+	and rax, -4096
+	mov rbx, r14
+	add rbx, 0xFFF
+	and rbx, -4096
+	mov r10, r14
+	xor r8d, r8d			; UC
+	call mtrr_build_range
+	jnc mtrr_build_hole
+
+mtrr_build_done:
+	ret
+
+mtrr_build_fail:
+	stc
+	ret
+
+; Set ZF if the E820 type in EAX is RAM that can be cached
+mtrr_build_ram:
+	cmp eax, 1			; Usable
+	je mtrr_build_ram_done
+	cmp eax, 3			; ACPI reclaimable
+mtrr_build_ram_done:
+	ret
+
+; Split RAX-RBX into naturally aligned power of 2 blocks of type R8
+mtrr_build_range:
+	cmp rax, rbx
+	jae mtrr_build_range_done	; Carry is clear
+	mov rcx, rbx
+	sub rcx, rax
+	bsr rcx, rcx			; Largest block that fits
+	test rax, rax
+	jz mtrr_build_range_add
+	bsf r13, rax			; Largest block the start is aligned to
+	cmp r13, rcx
+	jae mtrr_build_range_add
+	mov rcx, r13
+mtrr_build_range_add:
+	mov rdi, [MTRRState+MTRR_STATE_COUNT]
+	cmp rdi, r12
+	jae mtrr_build_range_full
+	shl rdi, 4
+	add rdi, MTRRState+MTRR_STATE_VAR
+	mov r13, rax
+	or r13, r8
+	mov [rdi], r13			; IA32_MTRR_PHYSBASEn
+	mov r13d, 1
+	shl r13, cl			; R13 is the block size
+	add rax, r13
+	neg r13
+	and r13, r9
+	bts r13, 11			; Valid (Bit 11)
+	mov [rdi+8], r13		; IA32_MTRR_PHYSMASKn
+	inc qword [MTRRState+MTRR_STATE_COUNT]
+	jmp mtrr_build_range
+
+mtrr_build_range_full:
+	stc
+mtrr_build_range_done:
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mtrr_load -- Load the MTRRs from MTRRState
+;		Caches must already be disabled and flushed
+;  IN:	Nothing
+; OUT:	RAX, RBX, RCX, RDX, RSI, RDI, R8, R9 modified
+mtrr_load:
+	cmp byte [p_MTRRMode], 0
+	je mtrr_load_done
+
+	mov ecx, 0x000002FF		; IA32_MTRR_DEF_TYPE
+	rdmsr
+	btr eax, 11			; Clear MTRR Enable (Bit 11) while they are changed
+	wrmsr
+
+	mov ecx, 0x000000FE		; IA32_MTRRCAP
+	rdmsr
+	mov ebx, eax
+	mov rsi, MTRRState+8
+	mov rdi, mtrr_fixed_msrs
+	mov r8d, MTRR_FIXED_COUNT
+mtrr_load_fixed:
+	movzx ecx, word [rdi]
+	add rdi, 2
+	lodsd
+	mov edx, [rsi]
+	add rsi, 4
+	bt ebx, 8			; Fixed range MTRRs are supported if bit 8 is set
+	jnc mtrr_load_fixed_next
+	wrmsr
+mtrr_load_fixed_next:
+	dec r8d
+	jnz mtrr_load_fixed
+
+	lodsq
+	mov r8d, eax			; Number of saved variable ranges
+	movzx r9d, bl			; Number of variable range MTRRs on this core
+	mov ecx, 0x00000200		; IA32_MTRR_PHYSBASE0
+mtrr_load_var:
+	cmp r9d, 0
+	je mtrr_load_deftype
+	xor eax, eax			; Ranges that were not saved are cleared
+	xor edx, edx
+	cmp r8d, 0
+	je mtrr_load_var_write
+	mov eax, [rsi]
+	mov edx, [rsi+4]
+	wrmsr				; IA32_MTRR_PHYSBASEn
+	inc ecx
+	mov eax, [rsi+8]
+	mov edx, [rsi+12]
+	add rsi, 16
+	dec r8d
+	jmp mtrr_load_var_mask
+mtrr_load_var_write:
+	wrmsr				; IA32_MTRR_PHYSBASEn
+	inc ecx
+mtrr_load_var_mask:
+	wrmsr				; IA32_MTRR_PHYSMASKn
+	inc ecx
+	dec r9d
+	jmp mtrr_load_var
+
+mtrr_load_deftype:
+	mov ecx, 0x000002FF		; IA32_MTRR_DEF_TYPE
+	mov eax, [MTRRState]
+	mov edx, [MTRRState+4]
+	wrmsr
+
+mtrr_load_done:
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; mtrr_check -- Compare the MTRRs of this core with MTRRState
+;		Variable ranges that are not valid in both are treated as equal
+;  IN:	Nothing
+; OUT:	Carry set if mtrr_load needs to be called
+;	RAX, RBX, RCX, RDX, RSI, RDI, R8, R9, R10, R11 modified
+mtrr_check:
+	cmp byte [p_MTRRMode], 0
+	je mtrr_check_same
+
+	mov ecx, 0x000002FF		; IA32_MTRR_DEF_TYPE
+	call mtrr_check_msr
+	cmp rax, [MTRRState]
+	jne mtrr_check_differ
+
+	mov ecx, 0x000000FE		; IA32_MTRRCAP
+	rdmsr
+	mov ebx, eax
+	bt ebx, 8			; Fixed range MTRRs are supported if bit 8 is set
+	jnc mtrr_check_var
+	mov rsi, MTRRState+8
+	mov rdi, mtrr_fixed_msrs
+	mov r8d, MTRR_FIXED_COUNT
+mtrr_check_fixed:
+	movzx ecx, word [rdi]
+	add rdi, 2
+	call mtrr_check_msr
+	cmp rax, [rsi]
+	jne mtrr_check_differ
+	add rsi, 8
+	dec r8d
+	jnz mtrr_check_fixed
+
+mtrr_check_var:
+	mov r8, [MTRRState+MTRR_STATE_COUNT]
+	mov rsi, MTRRState+MTRR_STATE_VAR
+	movzx r9d, bl			; Number of variable range MTRRs on this core
+	cmp r8d, r9d
+	ja mtrr_check_differ
+	mov ecx, 0x00000200		; IA32_MTRR_PHYSBASE0
+mtrr_check_var_next:
+	cmp r9d, 0
+	je mtrr_check_same
+	xor r10, r10			; Ranges that were not saved must not be valid
+	xor r11, r11
+	cmp r8d, 0
+	je mtrr_check_var_compare
+	mov r10, [rsi]			; Saved base
+	mov r11, [rsi+8]		; Saved mask
+	add rsi, 16
+	dec r8d
+mtrr_check_var_compare:
+	inc ecx
+	call mtrr_check_msr		; IA32_MTRR_PHYSMASKn
+	bt rax, 11			; Valid (Bit 11)
+	jc mtrr_check_var_valid
+	bt r11, 11
+	jc mtrr_check_differ
+	jmp mtrr_check_var_skip
+mtrr_check_var_valid:
+	cmp rax, r11
+	jne mtrr_check_differ
+	dec ecx
+	call mtrr_check_msr		; IA32_MTRR_PHYSBASEn
+	cmp rax, r10
+	jne mtrr_check_differ
+	inc ecx
+mtrr_check_var_skip:
+	inc ecx
+	dec r9d
+	jmp mtrr_check_var_next
+
+mtrr_check_same:
+	clc
+	ret
+
+mtrr_check_differ:
+	stc
+	ret
+
+mtrr_check_msr:				; Read MSR ECX into RAX
+	rdmsr
+	shl rdx, 32
+	or rax, rdx
+	ret
+; -----------------------------------------------------------------------------
+
+
+mtrr_fixed_msrs:
+dw 0x0250, 0x0258, 0x0259			; FIX64K_00000, FIX16K_80000, FIX16K_A0000
+dw 0x0268, 0x0269, 0x026A, 0x026B		; FIX4K_C0000 - FIX4K_D8000
+dw 0x026C, 0x026D, 0x026E, 0x026F		; FIX4K_E0000 - FIX4K_F8000
+MTRR_FIXED_COUNT	equ 11
+
+%ifndef NO_SCRUB
+; -----------------------------------------------------------------------------
+; mem_scrub -- Zero all free memory with the BSP and every AP with a mailbox
+; The cores take chunks of the higher half map in turn, so each extent is
+; zeroed once no matter how the cores are placed. This is called by the BSP
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+mem_scrub:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	push r8
+
+	mov eax, [p_mem_amount]
+	shr eax, 1			; 2MiB pages in the higher half map
+	mov [p_ScrubPages], rax
+	mov qword [p_ScrubNext], 0
+	mov dword [p_ScrubDone], 0
+	mov ebx, 1			; EBX = cores taking part, starting with the BSP
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov r8, rax			; R8 = starting TSC
+
+	call cpu_index
+	mov edx, ecx			; EDX = index of the BSP
+	xor ecx, ecx
+mem_scrub_start:
+	cmp cx, [p_cpu_detected]
+	jae mem_scrub_bsp
+	cmp ecx, edx
+	je mem_scrub_start_next
+	cmp byte [IM_CPU_STATUS+rcx], 1
+	jne mem_scrub_start_next	; Not activated
+	mov rsi, [IM_CPU_AREA+rcx*8]
+	cmp rsi, 0
+	je mem_scrub_start_next		; No mailbox
+	mov rax, mem_scrub_run
+	mov [rsi+PERCPU_MAILBOX+MAILBOX_ENTRY], rax
+mem_scrub_start_next:
+	inc ecx
+	jmp mem_scrub_start
+
+mem_scrub_bsp:
+	call mem_scrub_run
+	xor ecx, ecx
+mem_scrub_count:			; Count the cores that took the work
+	cmp cx, [p_cpu_detected]
+	jae mem_scrub_wait
+	cmp ecx, edx
+	je mem_scrub_count_next
+	cmp byte [IM_CPU_STATUS+rcx], 1
+	jne mem_scrub_count_next
+	mov rsi, [IM_CPU_AREA+rcx*8]
+	cmp rsi, 0
+	je mem_scrub_count_next
+	call percpu_mailbox_wait
+	jc mem_scrub_count_next		; Withdrawn, the core did not answer
+	inc ebx
+mem_scrub_count_next:
+	inc ecx
+	jmp mem_scrub_count
+mem_scrub_wait:				; Wait for every core to finish
+	pause
+	cmp [p_ScrubDone], ebx
+	jb mem_scrub_wait
+
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, r8
+	mov rcx, rax			; RCX = TSC ticks taken
+	mov eax, 1000
+	mul rcx
+	mov rbx, [p_TSCFrequency]
+	cmp rbx, 0
+	je mem_scrub_done
+	div rbx
+	mov [p_ScrubTime], eax		; Milliseconds
+	mov eax, [p_mem_amount]
+	mul rbx				; MiB * ticks per second
+	div rcx
+	mov [p_ScrubRate], eax		; MiB per second for all cores
+
+mem_scrub_done:
+	pop r8
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+
+
+; Zero chunks of the higher half map until there are none left
+; The rate of this core is saved in its data block if it has one
+mem_scrub_run:
+	push rdi
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	push r8
+
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov rsi, rax			; RSI = starting TSC
+	xor r8d, r8d			; R8 = pages zeroed by this core
+mem_scrub_run_chunk:
+	mov eax, SCRUB_CHUNK
+	lock xadd [p_ScrubNext], rax	; RAX = first page of the chunk
+	mov rcx, [p_ScrubPages]
+	sub rcx, rax
+	jbe mem_scrub_run_done		; Nothing left
+	cmp rcx, SCRUB_CHUNK
+	jbe mem_scrub_run_pages
+	mov ecx, SCRUB_CHUNK
+mem_scrub_run_pages:
+	add r8, rcx
+	shl rax, 21
+	mov rdi, 0xFFFF800000000000
+	add rdi, rax
+	shl rcx, 21-6			; 64 bytes per loop
+	xor eax, eax
+mem_scrub_run_line:
+	movnti [rdi], rax		; Non-temporal stores bypass the caches
+	movnti [rdi+8], rax
+	movnti [rdi+16], rax
+	movnti [rdi+24], rax
+	movnti [rdi+32], rax
+	movnti [rdi+40], rax
+	movnti [rdi+48], rax
+	movnti [rdi+56], rax
+	add rdi, 64
+	dec rcx
+	jnz mem_scrub_run_line
+	jmp mem_scrub_run_chunk
+
+mem_scrub_run_done:
+	sfence				; Make the stores visible before checking in
+	call cpu_index
+	jc mem_scrub_run_count
+	mov rbx, [IM_CPU_AREA+rcx*8]
+	cmp rbx, 0
+	je mem_scrub_run_count
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, rsi
+	jz mem_scrub_run_count
+	mov rcx, rax			; RCX = TSC ticks taken
+	mov rax, r8
+	shl rax, 1			; MiB zeroed
+	mul qword [p_TSCFrequency]
+	div rcx
+	mov [rbx+PERCPU_SCRUB_RATE], eax	; MiB per second for this core
+mem_scrub_run_count:
+	lock inc dword [p_ScrubDone]
+
+	pop r8
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	pop rdi
+	ret
+; -----------------------------------------------------------------------------
+%endif
+
+
+SCRUB_CHUNK		equ 8		; 2MiB pages taken by a core at a time
+
+
+; Layout of MTRRState
+; 0x00 IA32_MTRR_DEF_TYPE, 0x08 the 11 fixed range MTRRs, 0x60 the number of
+; variable ranges, 0x68 base and mask pairs for up to MTRR_VAR_MAX ranges
+MTRR_STATE_COUNT	equ 0x60
+MTRR_STATE_VAR		equ 0x68
+MTRR_VAR_MAX		equ 16
+
+
+; The PAT layout programmed by init_cpu keeps the power-on values for entries
+; 0-3 so PWT and PCD mean the same as always, entry 4 is changed to WC
+; PA0 WB, PA1 WT, PA2 UC-, PA3 UC, PA4 WC, PA5 WP, PA6 UC-, PA7 UC
+PAT_VALUE_LOW	equ 0x00070406		; PA3-PA0
+PAT_VALUE_HIGH	equ 0x00070501		; PA7-PA4
+PAT_RESET_LOW	equ 0x00070406		; Power-on value, PA3-PA0
+PAT_RESET_HIGH	equ 0x00070406		; PA7-PA4
+
+; Memory type bits for a 2MiB page
+PAGE_WB		equ 0x0000		; PA0
+PAGE_UC		equ 0x0018		; PA3 - PCD (Bit 4) and PWT (Bit 3)
+PAGE_WC		equ 0x1000		; PA4 - PAT (Bit 12)
+PAGE_TYPE_MASK	equ ~(PAGE_UC | PAGE_WC)	; Clears bits 12, 4, and 3
+
+
+; =============================================================================
+; EOF
@@ -0,0 +1,154 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; INIT NUMA - Give each CPU and each free memory extent its proximity domain
+; from the SRAT. This code is called by the BSP after init_acpi
+; =============================================================================
+
+
+init_numa:
+; Every core starts out in an unknown proximity domain
+	mov edi, IM_NUMA_CPU
+	movzx ecx, word [p_cpu_detected]
+	mov eax, 0xFFFFFFFF
+	rep stosd
+
+	mov rsi, [p_SRATAddress]
+	cmp rsi, 0
+	je init_numa_done		; No SRAT
+	mov r8d, [rsi+4]		; Length of SRAT in bytes
+	add r8, rsi			; R8 holds the end of the SRAT
+	add rsi, 48			; Skip to the first structure
+
+init_numa_next:
+	lea rax, [rsi+2]
+	cmp rax, r8
+	ja init_numa_done
+	movzx ecx, byte [rsi+1]		; Length
+	cmp ecx, 2
+	jb init_numa_done		; Not a valid structure
+	mov al, [rsi]			; Structure Type
+	cmp al, 0x00			; Processor Local APIC/SAPIC Affinity
+	je init_numa_apic
+	cmp al, 0x01			; Memory Affinity
+	je init_numa_memory
+	cmp al, 0x02			; Processor Local x2APIC Affinity
+	je init_numa_x2apic
+init_numa_skip:
+	add rsi, rcx
+	jmp init_numa_next
+
+init_numa_apic:				; Entry Type 0
+	test byte [rsi+4], 1		; Flags (Bit 0 set if enabled)
+	jz init_numa_skip
+	mov edx, [rsi+8]		; Proximity Domain bits 31:8 are in the upper 3 bytes
+	mov dl, [rsi+2]			; Proximity Domain bits 7:0
+	movzx eax, byte [rsi+3]		; APIC ID
+	jmp init_numa_cpu
+
+init_numa_x2apic:			; Entry Type 2
+	test byte [rsi+12], 1		; Flags (Bit 0 set if enabled)
+	jz init_numa_skip
+	mov edx, [rsi+4]		; Proximity Domain
+	mov eax, [rsi+8]		; x2APIC ID
+
+init_numa_cpu:				; EAX holds the APIC ID, EDX the Proximity Domain
+	push rcx
+	mov edi, IM_CPU_APICID
+	movzx ecx, word [p_cpu_detected]
+	jrcxz init_numa_cpu_done
+	repne scasd			; Find the APIC ID in the CPU table
+	jne init_numa_cpu_done
+	mov [rdi-4+IM_NUMA_CPU-IM_CPU_APICID], edx
+init_numa_cpu_done:
+	pop rcx
+	jmp init_numa_skip
+
+init_numa_memory:			; Entry Type 1
+	test byte [rsi+28], 1		; Flags (Bit 0 set if enabled)
+	jz init_numa_skip
+	push rcx
+	mov r9, [rsi+8]			; Base Address
+	mov r10, [rsi+16]		; Length
+	add r10, r9			; R10 holds the end of the range
+	mov r11d, [rsi+2]		; Proximity Domain
+	mov ebx, IM_MEMEXTENTS
+	movzx ecx, word [p_MemExtents]
+init_numa_memory_extent:		; Add the part of each extent inside the range
+	jrcxz init_numa_memory_done
+	mov rax, [rbx]			; Base of the extent
+	mov rdx, [rbx+8]
+	add rdx, rax			; End of the extent
+	cmp rax, r9
+	cmovb rax, r9
+	cmp rdx, r10
+	cmova rdx, r10
+	cmp rax, rdx
+	jae init_numa_memory_skip	; They do not overlap
+	call init_numa_add
+init_numa_memory_skip:
+	add ebx, 32
+	dec ecx
+	jmp init_numa_memory_extent
+init_numa_memory_done:
+	pop rcx
+	jmp init_numa_skip
+
+init_numa_done:
+	ret
+
+
+; -----------------------------------------------------------------------------
+; init_numa_add -- Insert a range into the memory table, sorted by base
+;  IN:	RAX = Base of the range
+;	RDX = End of the range
+;	R11D = Proximity Domain
+; OUT:	Nothing, all registers preserved
+init_numa_add:
+	push rdi
+	push rcx
+	push rdx
+
+	movzx ecx, word [p_NUMAMem]
+	cmp ecx, IM_NUMA_MEM_MAX
+	jae init_numa_add_done		; The table is full
+	inc word [p_NUMAMem]
+	mov edi, ecx
+	shl edi, 5
+	add edi, IM_NUMA_MEM		; RDI points to the blank record at the end
+init_numa_add_shift:
+	jrcxz init_numa_add_store
+	cmp rax, [rdi-32]
+	jae init_numa_add_store
+	mov rdx, [rdi-32]		; Move the previous entry up by one
+	mov [rdi], rdx
+	mov rdx, [rdi-24]
+	mov [rdi+8], rdx
+	mov rdx, [rdi-16]
+	mov [rdi+16], rdx
+	mov rdx, [rdi-8]
+	mov [rdi+24], rdx
+	sub edi, 32
+	dec ecx
+	jmp init_numa_add_shift
+init_numa_add_store:
+	pop rdx
+	push rdx
+	mov [rdi], rax			; Base
+	sub rdx, rax
+	mov [rdi+8], rdx		; Length
+	mov [rdi+16], r11d		; Proximity Domain
+	mov dword [rdi+20], 0
+	mov qword [rdi+24], 0
+
+init_numa_add_done:
+	pop rdx
+	pop rcx
+	pop rdi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; =============================================================================
+; EOF
@@ -0,0 +1,823 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; INIT PAYLOAD - Move a payload with a header to its load address. This code
+; is called by the BSP in 32-bit mode before the low memory is cleared. An LZ4
+; payload is staged after its load address and decompressed in 64-bit mode,
+; and the segments of an ELF64 payload are copied to their own addresses
+; =============================================================================
+
+
+BITS 32
+
+; -----------------------------------------------------------------------------
+; payload_load -- Copy the payload described by the header after Pure64
+; The UEFI loader copies the payload itself and PXE loads the whole file. The
+; MBR only reads the first 32KiB so the rest is read in chunks via the BIOS.
+; The Multiboot2 loader leaves the payload where GRUB put it and gives its
+; address in the header. A flat payload is moved to its load address. An LZ4
+; payload is decompressed from there unless it overlaps the destination, and an
+; ELF64 file is used in place unless it is in the low memory Pure64 clears.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+payload_load:
+	pushad
+	mov ebx, PAYLOAD_HEADER
+	cmp dword [ebx], PAYLOAD_MAGIC
+	jne payload_load_done		; No header, the legacy copy is used
+	cmp byte [0x8005], 'U'
+	je payload_load_done		; The UEFI loader has already copied it
+	lea esi, [ebx+PAYLOAD_HEADER_SIZE]
+	mov edi, [ebx+PAYLOAD_ADDRESS]
+	test byte [ebx+PAYLOAD_FLAGS], PAYLOAD_LZ4
+	jz payload_load_dest
+	add edi, [ebx+PAYLOAD_USIZE]	; Stage compressed data after where it decompresses to
+payload_load_dest:
+	mov ecx, [ebx+PAYLOAD_SIZE]
+	mov eax, [ebx+PAYLOAD_SOURCE]
+	test eax, eax
+	jz payload_load_file
+	mov esi, eax			; The loader left the payload data here
+	cmp esi, 0x00200000
+	jb payload_load_moved		; Low memory is cleared before it is used
+	test byte [ebx+PAYLOAD_FLAGS], PAYLOAD_LZ4
+	jnz payload_load_lz4
+	test byte [ebx+PAYLOAD_FLAGS], PAYLOAD_ELF
+	jnz payload_load_done		; payload_elf reads the file in place
+	jmp payload_load_moved		; A flat payload is run at its load address
+payload_load_lz4:
+	mov eax, [ebx+PAYLOAD_ADDRESS]
+	mov edx, [ebx+PAYLOAD_USIZE]
+	add edx, eax			; EDX = end of the decompressed payload
+	cmp esi, edx
+	jae payload_load_done		; The compressed data is after it, use it in place
+	lea edx, [esi+ecx]
+	cmp edx, eax
+	jbe payload_load_done		; The compressed data is before it, use it in place
+payload_load_moved:
+	mov dword [ebx+PAYLOAD_SOURCE], 0	; The data will be where it is normally found
+	jmp payload_load_copy
+payload_load_file:
+	cmp byte [0x8005], 'B'
+	jne payload_load_copy		; Not loaded by the MBR, the whole file is in memory
+
+	; Work out how much of the payload was read by the MBR
+	movzx eax, word [MBR_DAP+2]	; Sectors read by the MBR
+	mov edx, [MBR_DAP+8]		; First sector of Pure64
+	add edx, eax
+	mov [payload_dap+8], edx	; The next sector follows the ones already read
+	shl eax, 9			; Convert sectors to bytes
+	sub eax, PURE64SIZE + PAYLOAD_HEADER_SIZE
+	cmp ecx, eax
+	jbe payload_load_copy		; The payload fit in what the MBR read
+	sub ecx, eax			; ECX = bytes left on the disk
+	xchg eax, ecx
+	rep movsb			; Copy the part that was read by the MBR
+	mov ecx, eax
+
+payload_load_next:
+	mov eax, ecx
+	add eax, 511
+	shr eax, 9			; Sectors left, rounded up
+	cmp eax, PAYLOAD_CHUNK
+	jbe payload_load_read
+	mov eax, PAYLOAD_CHUNK
+payload_load_read:
+	mov [payload_dap+2], ax
+	call payload_read
+	add [payload_dap+8], eax
+	shl eax, 9			; Bytes read
+	mov esi, PAYLOAD_BOUNCE
+	sub ecx, eax
+	jae payload_load_chunk
+	add eax, ecx			; The last chunk is only partly used
+	xor ecx, ecx
+payload_load_chunk:
+	xchg eax, ecx
+	rep movsb			; Copy the chunk out of the bounce buffer
+	xchg eax, ecx
+	test ecx, ecx
+	jnz payload_load_next
+	jmp payload_load_done
+
+payload_load_copy:			; The source and destination may overlap
+	cmp edi, esi
+	je payload_load_done		; Already in place
+	jb payload_load_forward
+	lea esi, [esi+ecx-1]		; Copy backwards if the destination is higher
+	lea edi, [edi+ecx-1]
+	std
+	rep movsb
+	cld
+	jmp payload_load_done
+payload_load_forward:
+	rep movsb
+
+payload_load_done:
+	popad
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; payload_read -- Read sectors into the bounce buffer via the BIOS
+; This drops back to real mode for the read. It does not return on an error.
+;  IN:	payload_dap set with the sector count and starting sector
+; OUT:	Nothing, all registers preserved
+payload_read:
+	pushad
+	lgdt [GDTR32]			; Pure64 GDT with the 16-bit descriptors
+	jmp 0x18:payload_read_16	; 16-bit protected mode
+
+BITS 16
+payload_read_16:
+	mov ax, 0x20
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	mov eax, cr0
+	and al, 0xFE			; Clear protected mode bit
+	mov cr0, eax
+	jmp 0x0000:payload_read_rm
+
+payload_read_rm:
+	xor ax, ax
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	sti
+	mov ah, 0x42			; Extended Read
+	mov dl, [MBR_DRIVE]
+	mov si, payload_dap
+	int 0x13
+	jc payload_read_fail
+	cli
+	mov eax, cr0
+	or al, 0x01			; Set protected mode bit
+	mov cr0, eax
+	jmp 8:payload_read_pm
+
+payload_read_fail:
+%ifndef NO_SERIAL
+	mov si, msg_payload_fail
+	mov dx, 0			; Port 0
+payload_read_fail_next:
+	mov ah, 0x01			; Serial - Write character to port
+	lodsb
+	cmp al, 0
+	je payload_read_halt
+	int 0x14
+	jmp payload_read_fail_next
+%endif
+payload_read_halt:
+	hlt
+	jmp payload_read_halt
+
+BITS 32
+payload_read_pm:
+	mov eax, 16
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	popad
+	ret
+; -----------------------------------------------------------------------------
+
+
+BITS 64
+
+; -----------------------------------------------------------------------------
+; payload_unpack -- Decompress an LZ4 payload and check the payload checksum
+; The compressed data was staged directly after the load address, or is still
+; where the loader left it if the header gives its address. The payload
+; is checked if it was compressed or the header has a checksum. On an error a
+; message is sent to the serial port and the system is halted.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+payload_unpack:
+	push rsi
+	push rdi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	mov ebx, PAYLOAD_HEADER
+	cmp dword [rbx], PAYLOAD_MAGIC
+	jne payload_unpack_done		; No header
+	mov eax, [rbx+PAYLOAD_SIZE]
+	test byte [rbx+PAYLOAD_FLAGS], PAYLOAD_LZ4
+	jz payload_unpack_check
+
+	mov edi, [rbx+PAYLOAD_ADDRESS]
+	mov ecx, [rbx+PAYLOAD_USIZE]
+	mov esi, edi
+	add rsi, rcx			; RSI = compressed data
+	mov eax, [rbx+PAYLOAD_SOURCE]
+	test eax, eax
+	jz payload_unpack_lz4
+	mov esi, eax			; Decompress it from where the loader left it
+payload_unpack_lz4:
+	mov edx, [rbx+PAYLOAD_SIZE]
+	call lz4_decompress
+	jc payload_unpack_fail
+	mov eax, [rbx+PAYLOAD_USIZE]
+	cmp rcx, rax
+	jne payload_unpack_fail		; Size does not match the header
+
+payload_unpack_check:
+	mov [p_PayloadSize], eax
+	test byte [rbx+PAYLOAD_FLAGS], PAYLOAD_LZ4
+	jnz payload_unpack_sum
+	cmp dword [rbx+PAYLOAD_CHECKSUM], 0
+	je payload_unpack_done		; Not compressed and no checksum to check
+payload_unpack_sum:
+	call payload_file
+	mov ecx, eax
+	call adler32
+	mov [p_PayloadChecksum], eax
+	mov edx, [rbx+PAYLOAD_CHECKSUM]
+	test edx, edx
+	jz payload_unpack_done
+	cmp eax, edx
+	jne payload_unpack_fail
+
+payload_unpack_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rdi
+	pop rsi
+	ret
+
+payload_unpack_fail:
+%ifndef NO_SERIAL
+	mov rsi, msg_payload_bad
+	mov dx, 0x03F8			; Address of first serial port
+payload_unpack_fail_next:
+	add dx, 5			; Offset to Line Status Register
+	in al, dx
+	sub dx, 5			; Back to to base
+	test al, 0x20
+	jz payload_unpack_fail_next
+	lodsb
+	test al, al
+	jz payload_unpack_halt
+	out dx, al			; Send the char to the serial port
+	jmp payload_unpack_fail_next
+%endif
+payload_unpack_halt:
+	hlt
+	jmp payload_unpack_halt
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; payload_reserve -- Remove the memory used by the payload from the free extents
+; This is called after payload_unpack so only the uncompressed payload and the
+; segments of an ELF64 payload are kept, rounded out to 2MiB pages.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+payload_reserve:
+	push rsi
+	push rdi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	cmp dword [PAYLOAD_HEADER], PAYLOAD_MAGIC
+	jne payload_reserve_done	; The legacy payload is below the first extent
+	call payload_file
+	mov eax, esi
+	mov edx, [p_PayloadSize]
+	call payload_reserve_range
+
+	test byte [PAYLOAD_HEADER+PAYLOAD_FLAGS], PAYLOAD_ELF
+	jz payload_reserve_done
+	call payload_elf_headers
+payload_reserve_segment:
+	test ecx, ecx
+	jz payload_reserve_done
+	cmp dword [rbx], PT_LOAD
+	jne payload_reserve_next
+	mov rax, [rbx+ELF_PH_PADDR]
+	mov rdx, [rbx+ELF_PH_MEMSZ]
+	push rcx
+	call payload_reserve_range
+	pop rcx
+payload_reserve_next:
+	add rbx, rdi
+	dec ecx
+	jmp payload_reserve_segment
+
+payload_reserve_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rdi
+	pop rsi
+	ret
+
+; IN:	RAX = start, RDX = length
+payload_reserve_range:
+	push rdi
+	add rdx, rax
+	and rax, -0x200000
+	add rdx, 0x1FFFFF
+	and rdx, -0x200000
+	mov esi, IM_MEMEXTENTS
+	mov edi, p_MemExtents
+	mov ecx, IM_MEMEXTENTS_MAX
+	call mem_reserve
+	pop rdi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; payload_elf -- Copy the segments of an ELF64 payload to their addresses
+; The ELF file is at the load address, or where the loader left it. Each
+; PT_LOAD segment is copied to its physical address and the rest of its memory
+; size is cleared. The segments must be below 4GiB and clear of the file. A
+; file left by the loader that is in the way is moved to the load address
+; first. On an error a message is sent to the serial port and the system is
+; halted.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+payload_elf:
+	push rsi
+	push rdi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	push r8
+	push r9
+
+	cmp dword [PAYLOAD_HEADER], PAYLOAD_MAGIC
+	jne payload_elf_done
+	test byte [PAYLOAD_HEADER+PAYLOAD_FLAGS], PAYLOAD_ELF
+	jz payload_elf_done
+payload_elf_file:
+	call payload_file
+	cmp dword [rsi], 0x464C457F	; 0x7F, 'ELF'
+	jne payload_unpack_fail
+	cmp word [rsi+4], 0x0102	; 64-bit, little endian
+	jne payload_unpack_fail
+	cmp word [rsi+ELF_MACHINE], 0x3E	; x86-64
+	jne payload_unpack_fail
+	mov rax, [rsi+ELF_ENTRY]
+	mov [p_PayloadEntry], rax
+	call payload_elf_headers
+	mov r8, rsi			; R8 = start of the file
+	mov r9d, [p_PayloadSize]
+	add r9, rsi			; R9 = end of the file
+
+payload_elf_segment:
+	test ecx, ecx
+	jz payload_elf_done
+	cmp dword [rbx], PT_LOAD
+	jne payload_elf_next
+	push rcx
+	push rdi
+	mov rdi, [rbx+ELF_PH_PADDR]
+	mov rdx, [rbx+ELF_PH_MEMSZ]
+	mov rcx, [rbx+ELF_PH_FILESZ]
+	cmp rcx, rdx
+	ja payload_unpack_fail		; More in the file than in memory
+	lea rax, [rdi+rdx]
+	mov rsi, 0x100000000
+	cmp rax, rsi
+	ja payload_unpack_fail		; Not in the identity map with 2MiB pages
+	cmp rdi, r9
+	jae payload_elf_clear
+	cmp rax, r8
+	ja payload_elf_move		; The segment would overwrite the file
+payload_elf_clear:
+	mov rsi, [rbx+ELF_PH_OFFSET]
+	lea rax, [rsi+rcx]
+	add rsi, r8
+	add rax, r8
+	cmp rax, r9
+	ja payload_unpack_fail		; The segment is past the end of the file
+	sub rdx, rcx			; RDX = bytes to clear after the file data
+	rep movsb
+	mov rcx, rdx
+	xor eax, eax
+	rep stosb			; Fast string stores for the BSS
+	pop rdi
+	pop rcx
+payload_elf_next:
+	add rbx, rdi
+	dec ecx
+	jmp payload_elf_segment
+
+payload_elf_move:			; Move the file from where the loader left it
+	pop rdi
+	pop rcx
+	cmp dword [PAYLOAD_HEADER+PAYLOAD_SOURCE], 0
+	je payload_unpack_fail		; Already at the load address
+	mov rsi, r8
+	mov edi, [PAYLOAD_HEADER+PAYLOAD_ADDRESS]
+	mov ecx, [p_PayloadSize]
+	cmp rdi, rsi
+	jb payload_elf_move_forward
+	lea rsi, [rsi+rcx-1]		; Copy backwards if the destination is higher
+	lea rdi, [rdi+rcx-1]
+	std
+	rep movsb
+	cld
+	jmp payload_elf_moved
+payload_elf_move_forward:
+	rep movsb
+payload_elf_moved:
+	mov dword [PAYLOAD_HEADER+PAYLOAD_SOURCE], 0
+	jmp payload_elf_file		; Copy all of the segments again from there
+
+payload_elf_done:
+	pop r9
+	pop r8
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rdi
+	pop rsi
+	ret
+
+; Return the address of the uncompressed payload in ESI. This is where the
+; loader left it, unless it is at the load address or was decompressed there
+payload_file:
+	mov esi, [PAYLOAD_HEADER+PAYLOAD_ADDRESS]
+	test byte [PAYLOAD_HEADER+PAYLOAD_FLAGS], PAYLOAD_LZ4
+	jnz payload_file_done
+	cmp dword [PAYLOAD_HEADER+PAYLOAD_SOURCE], 0
+	je payload_file_done
+	mov esi, [PAYLOAD_HEADER+PAYLOAD_SOURCE]
+payload_file_done:
+	ret
+
+; Return the program headers of the ELF64 file
+; OUT:	RBX = first program header, ECX = number of them, EDI = size of each
+payload_elf_headers:
+	push rsi
+	call payload_file
+	mov ebx, esi
+	pop rsi
+	movzx ecx, word [rbx+ELF_PHNUM]
+	movzx edi, word [rbx+ELF_PHENTSIZE]
+	add rbx, [rbx+ELF_PHOFF]
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; payload_map -- Map the higher half segments of an ELF64 payload
+; A PT_LOAD segment with a virtual address in the higher half is mapped to its
+; physical address with 2MiB pages, so its virtual and physical addresses must
+; have the same offset in a 2MiB page. It must be above the map of free memory
+; made by mem_map, which mem_scrub clears. On an error the system is halted.
+;  IN:	R14 = Next free page table, as left by mem_map
+; OUT:	Nothing, all registers preserved except R14
+payload_map:
+	push rsi
+	push rdi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	push r10
+	push r11
+
+	cmp dword [PAYLOAD_HEADER], PAYLOAD_MAGIC
+	jne payload_map_done
+	test byte [PAYLOAD_HEADER+PAYLOAD_FLAGS], PAYLOAD_ELF
+	jz payload_map_done
+	call payload_elf_headers
+
+payload_map_segment:
+	test ecx, ecx
+	jz payload_map_flush
+	cmp dword [rbx], PT_LOAD
+	jne payload_map_next
+	mov rax, [rbx+ELF_PH_VADDR]
+	bt rax, 63
+	jnc payload_map_next		; Not in the higher half
+	mov r10d, [p_mem_amount]
+	shl r10, 20
+	mov r11, 0xFFFF800000000000
+	add r10, r11			; R10 = end of the map of free memory
+	cmp rax, r10
+	jb payload_unpack_fail		; It would replace part of the map of free memory
+	mov rdx, [rbx+ELF_PH_PADDR]
+	mov r10, rax
+	xor r10, rdx
+	test r10d, 0x1FFFFF
+	jnz payload_unpack_fail		; Can not be mapped with 2MiB pages
+	mov r10, rax
+	and r10, -0x200000		; R10 = first 2MiB page to map
+	lea r11, [rax+0x1FFFFF]
+	add r11, [rbx+ELF_PH_MEMSZ]
+	and r11, -0x200000		; R11 = end of the pages to map
+	and rdx, -0x200000
+	push rdi
+payload_map_page:
+	cmp r10, r11
+	jae payload_map_page_done
+	mov rax, r10
+	call payload_map_pde
+	jc payload_unpack_fail		; Out of page tables
+	lea rax, [rdx+0x187]		; Bits 0 (P), 1 (R/W), 2 (U/S), 7 (PS), and 8 (G) set
+	mov [rdi], rax
+	add r10, 0x200000
+	add rdx, 0x200000
+	jmp payload_map_page
+payload_map_page_done:
+	pop rdi
+payload_map_next:
+	add rbx, rdi
+	dec ecx
+	jmp payload_map_segment
+
+payload_map_flush:			; Flush the global TLB entries
+	mov rax, cr4
+	btr rax, 7			; PGE
+	mov cr4, rax
+	bts rax, 7
+	mov cr4, rax
+
+payload_map_done:
+	pop r11
+	pop r10
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rdi
+	pop rsi
+	ret
+
+; Return the address of the PDE for the virtual address in RAX in RDI, making
+; the PDP and PD if they are missing. Carry set if there are no page tables left
+payload_map_pde:
+	push rsi
+	push rbx
+	mov rbx, rax
+	shr rax, 39
+	and eax, 511
+	lea rsi, [0x2000+rax*8]		; PML4E
+	call payload_map_table
+	jc payload_map_pde_done
+	mov rax, rbx
+	shr rax, 30
+	and eax, 511
+	lea rsi, [rdi+rax*8]		; PDPTE
+	call payload_map_table
+	jc payload_map_pde_done
+	mov rax, rbx
+	shr rax, 21
+	and eax, 511
+	lea rdi, [rdi+rax*8]		; PDE
+	clc
+payload_map_pde_done:
+	mov rax, rbx
+	pop rbx
+	pop rsi
+	ret
+
+; Return the table the entry at RSI points to in RDI. A missing table is taken
+; from the page table pool, and a 1GiB page is split into 2MiB pages
+payload_map_table:
+	mov rdi, [rsi]
+	test edi, 1
+	jz payload_map_table_new	; Not present
+	test edi, 0x80
+	jnz payload_map_table_split	; 1GiB page
+	mov rax, 0x000FFFFFFFFFF000
+	and rdi, rax
+	clc
+	ret
+payload_map_table_new:
+	call mem_alloc_table
+	jc payload_map_table_full
+	lea rax, [rdi+7]		; Bits 0 (P), 1 (R/W), 2 (U/S)
+	mov [rsi], rax
+	clc
+	ret
+payload_map_table_split:
+	push rcx
+	mov rax, rdi			; The 2MiB pages keep the same bits
+	call mem_alloc_table
+	jc payload_map_table_split_full
+	push rdi
+	mov ecx, 512
+payload_map_table_split_next:
+	stosq
+	add rax, 0x200000
+	dec ecx
+	jnz payload_map_table_split_next
+	pop rdi
+	lea rax, [rdi+7]
+	mov [rsi], rax
+	pop rcx
+	clc
+	ret
+payload_map_table_split_full:
+	pop rcx
+payload_map_table_full:
+	stc
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; lz4_decompress -- Decompress an LZ4 block
+;  IN:	RSI = compressed data
+;	RDI = destination
+;	RDX = size of the compressed data in bytes
+;	RCX = size of the destination in bytes
+; OUT:	RCX = decompressed size in bytes
+;	Carry set if the data is malformed or does not fit in the destination
+;	All other registers preserved
+lz4_decompress:
+	push rsi
+	push rdi
+	push rdx
+	push rbx
+	push rax
+	push r8
+	push r9
+
+	add rdx, rsi			; RDX = end of the compressed data
+	mov r8, rdi			; R8 = start of the destination
+	lea r9, [rdi+rcx]		; R9 = end of the destination
+
+lz4_decompress_sequence:
+	cmp rsi, rdx
+	jae lz4_decompress_error
+	movzx ebx, byte [rsi]		; Token
+	inc rsi
+	mov ecx, ebx
+	shr ecx, 4			; Literal length
+	call lz4_decompress_length
+	jc lz4_decompress_error
+	mov rax, rdx
+	sub rax, rsi
+	cmp rcx, rax
+	ja lz4_decompress_error		; Literals past the end of the input
+	mov rax, r9
+	sub rax, rdi
+	cmp rcx, rax
+	ja lz4_decompress_error		; Literals past the end of the destination
+	rep movsb			; Copy the literals
+	cmp rsi, rdx
+	je lz4_decompress_end		; The last sequence only has literals
+
+	lea rax, [rsi+2]
+	cmp rax, rdx
+	ja lz4_decompress_error
+	movzx eax, word [rsi]		; Match offset
+	add rsi, 2
+	test eax, eax
+	jz lz4_decompress_error
+	mov ecx, ebx
+	and ecx, 0x0F			; Match length, less 4
+	mov ebx, eax			; EBX = match offset
+	call lz4_decompress_length
+	jc lz4_decompress_error
+	add rcx, 4
+	push rsi
+	mov rsi, rdi
+	sub rsi, rbx			; RSI = start of the match
+	mov rax, rsi
+	sub rax, r8
+	jb lz4_decompress_bad_match	; Match before the start of the destination
+	mov rax, r9
+	sub rax, rdi
+	cmp rcx, rax
+	ja lz4_decompress_bad_match	; Match past the end of the destination
+	rep movsb			; Copy the match, overlapping copies repeat the pattern
+	pop rsi
+	jmp lz4_decompress_sequence
+
+lz4_decompress_bad_match:
+	pop rsi
+lz4_decompress_error:
+	stc
+	jmp lz4_decompress_done
+
+lz4_decompress_end:
+	mov rcx, rdi
+	sub rcx, r8			; Decompressed size
+	clc
+
+lz4_decompress_done:
+	pop r9
+	pop r8
+	pop rax
+	pop rbx
+	pop rdx
+	pop rdi
+	pop rsi
+	ret
+
+; Add the extra length bytes of a literal or match length of 15
+; IN:	RCX = length from the token, RSI = compressed data, RDX = end of it
+; OUT:	RCX = length, RSI updated, carry set if past the end of the input
+lz4_decompress_length:
+	cmp ecx, 0x0F
+	jne lz4_decompress_length_done
+lz4_decompress_length_next:
+	cmp rsi, rdx
+	jae lz4_decompress_length_error
+	movzx eax, byte [rsi]
+	inc rsi
+	add rcx, rax
+	cmp al, 0xFF
+	je lz4_decompress_length_next
+lz4_decompress_length_done:
+	clc
+	ret
+lz4_decompress_length_error:
+	stc
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; adler32 -- Compute the Adler-32 checksum of a block of memory
+;  IN:	RSI = address of the data
+;	RCX = size of the data in bytes
+; OUT:	EAX = Adler-32 checksum
+;	All other registers preserved
+adler32:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push r8
+	push r9
+
+	mov r8d, 1			; A
+	xor r9d, r9d			; B
+	mov ebx, 65521
+adler32_block:
+	test rcx, rcx
+	jz adler32_done
+	mov edx, 5552			; Largest block that can not overflow B
+	cmp rcx, rdx
+	cmovb edx, ecx
+	sub rcx, rdx
+adler32_byte:
+	movzx eax, byte [rsi]
+	inc rsi
+	add r8d, eax
+	add r9d, r8d
+	dec edx
+	jnz adler32_byte
+	mov eax, r8d
+	div ebx				; EDX is zero here
+	mov r8d, edx
+	mov eax, r9d
+	xor edx, edx
+	div ebx
+	mov r9d, edx
+	jmp adler32_block
+
+adler32_done:
+	mov eax, r9d
+	shl eax, 16
+	or eax, r8d
+
+	pop r9
+	pop r8
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; ELF64 file header
+ELF_MACHINE		equ 0x12	; DW - 0x3E for x86-64
+ELF_ENTRY		equ 0x18	; DQ - Entry point
+ELF_PHOFF		equ 0x20	; DQ - Offset of the program headers in the file
+ELF_PHENTSIZE		equ 0x36	; DW - Size of each program header
+ELF_PHNUM		equ 0x38	; DW - Number of program headers
+
+; ELF64 program header
+PT_LOAD			equ 1		; Type of a loadable segment
+ELF_PH_OFFSET		equ 0x08	; DQ - Offset of the segment in the file
+ELF_PH_VADDR		equ 0x10	; DQ - Virtual address
+ELF_PH_PADDR		equ 0x18	; DQ - Physical address
+ELF_PH_FILESZ		equ 0x20	; DQ - Size in the file
+ELF_PH_MEMSZ		equ 0x28	; DQ - Size in memory
+
+
+; =============================================================================
+; EOF
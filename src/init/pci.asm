@@ -0,0 +1,342 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; INIT PCI - Enumerate the PCIe functions through the ECAM ranges from the MCFG
+; with every core and build a sorted device table for the payload. This code
+; is called by the BSP if cfg_pci is set
+; =============================================================================
+
+
+; -----------------------------------------------------------------------------
+; init_pci -- Take the memory for the device table from the free memory
+; This must run before mem_map so the table is not in the higher half map.
+;  IN:	Nothing
+; OUT:	p_PCITable is set, or 0 if the scan will not run
+;	All other registers except RSP may be modified
+init_pci:
+	mov qword [p_PCITable], 0
+	cmp byte [cfg_pci], 1
+	jne init_pci_done
+	cmp word [p_PCIECount], 0
+	je init_pci_done		; No ECAM ranges in the MCFG
+	mov ecx, PCI_TABLE_SIZE
+	mov r13, 0x100000000		; The identity map always covers the first 4GiB
+	mov r15d, 0xFFFFFFFF		; From any proximity domain
+	call init_percpu_alloc
+	jc init_pci_done		; No room, the scan is skipped
+	mov [p_PCITable], rax
+init_pci_done:
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; pci_scan -- Enumerate every bus with the BSP and every AP with a mailbox
+; The cores take buses in turn and add each function they find to the table,
+; which is then sorted by segment, bus, device, and function.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+pci_scan:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	cmp qword [p_PCITable], 0
+	je pci_scan_done
+	mov dword [p_PCICount], 0
+	mov dword [p_PCINext], 0
+	mov dword [p_PCIDone], 0
+	mov ebx, 1			; EBX = cores taking part, starting with the BSP
+
+	call cpu_index
+	mov edx, ecx			; EDX = index of the BSP
+	xor ecx, ecx
+pci_scan_start:
+	cmp cx, [p_cpu_detected]
+	jae pci_scan_bsp
+	cmp ecx, edx
+	je pci_scan_start_next
+	cmp byte [IM_CPU_STATUS+rcx], 1
+	jne pci_scan_start_next		; Not activated
+	mov rsi, [IM_CPU_AREA+rcx*8]
+	cmp rsi, 0
+	je pci_scan_start_next		; No mailbox
+	mov rax, pci_scan_run
+	mov [rsi+PERCPU_MAILBOX+MAILBOX_ENTRY], rax
+pci_scan_start_next:
+	inc ecx
+	jmp pci_scan_start
+
+pci_scan_bsp:
+	call pci_scan_run
+	xor ecx, ecx
+pci_scan_count:				; Count the cores that took the work
+	cmp cx, [p_cpu_detected]
+	jae pci_scan_wait
+	cmp ecx, edx
+	je pci_scan_count_next
+	cmp byte [IM_CPU_STATUS+rcx], 1
+	jne pci_scan_count_next
+	mov rsi, [IM_CPU_AREA+rcx*8]
+	cmp rsi, 0
+	je pci_scan_count_next
+	call percpu_mailbox_wait
+	jc pci_scan_count_next		; Withdrawn, the core did not answer
+	inc ebx
+pci_scan_count_next:
+	inc ecx
+	jmp pci_scan_count
+pci_scan_wait:				; Wait for every core to finish
+	pause
+	cmp [p_PCIDone], ebx
+	jb pci_scan_wait
+
+	cmp dword [p_PCICount], PCI_TABLE_MAX
+	jbe pci_scan_sort
+	mov dword [p_PCICount], PCI_TABLE_MAX	; The table is full
+pci_scan_sort:
+	call pci_sort
+	imul eax, [p_PCICount], PCI_ENTRY_SIZE
+	add rax, [p_PCITable]
+	xor ecx, ecx
+pci_scan_blank:				; Mark the end of the table
+	mov qword [rax+rcx], 0
+	add ecx, 8
+	cmp ecx, PCI_ENTRY_SIZE
+	jne pci_scan_blank
+
+pci_scan_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+
+
+; Scan buses until there are none left
+; Buses with configuration space above 4GiB are skipped as they may not be mapped
+pci_scan_run:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	push r9
+
+pci_scan_run_next:
+	mov eax, 1
+	lock xadd [p_PCINext], eax	; EAX = index of the next bus over all ranges
+	mov esi, IM_PCIE
+	movzx ecx, word [p_PCIECount]
+pci_scan_run_range:
+	cmp ecx, 0
+	je pci_scan_run_done		; Nothing left
+	movzx edx, byte [rsi+10]	; Start PCI bus number
+	movzx ebx, byte [rsi+11]	; End PCI bus number
+	sub ebx, edx
+	jb pci_scan_run_range_next	; Not a valid range
+	inc ebx				; EBX = buses in this range
+	cmp eax, ebx
+	jb pci_scan_run_bus
+	sub eax, ebx
+pci_scan_run_range_next:
+	add esi, 16
+	dec ecx
+	jmp pci_scan_run_range
+
+pci_scan_run_bus:
+	add eax, edx			; EAX = bus number
+	mov r9, rax
+	shl r9, 20			; Each bus uses 1MiB of configuration space
+	add r9, [rsi]			; R9 = configuration space of the bus
+	lea rdx, [r9+0x100000]
+	mov rbx, 0x100000000
+	cmp rdx, rbx
+	ja pci_scan_run_next
+	movzx edx, word [rsi+8]		; PCI Segment Group Number
+	shl edx, 16
+	mov dh, al			; EDX = segment and bus, as in the table entry
+	call pci_scan_bus
+	jmp pci_scan_run_next
+
+pci_scan_run_done:
+	lock inc dword [p_PCIDone]
+
+	pop r9
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+
+
+; Add every function on a bus to the table
+; IN: R9 = configuration space of the bus, EDX = segment and bus
+pci_scan_bus:
+	push rsi
+	push rcx
+	push rax
+	xor ecx, ecx			; ECX = device and function
+pci_scan_bus_next:
+	mov esi, ecx
+	shl esi, 12			; Each function uses 4KiB
+	add rsi, r9
+	mov eax, [rsi]			; Vendor ID and Device ID
+	cmp ax, 0xFFFF
+	je pci_scan_bus_none
+	call pci_scan_add
+	test ecx, 7
+	jnz pci_scan_bus_skip
+	test byte [rsi+0x0E], 0x80	; Header Type bit 7 is set for a multi-function device
+	jnz pci_scan_bus_skip
+	or ecx, 7			; Skip the other functions
+	jmp pci_scan_bus_skip
+pci_scan_bus_none:
+	test ecx, 7
+	jnz pci_scan_bus_skip
+	or ecx, 7			; No function 0, so there is no device
+pci_scan_bus_skip:
+	inc ecx
+	cmp ecx, 256
+	jb pci_scan_bus_next
+	pop rax
+	pop rcx
+	pop rsi
+	ret
+
+
+; Add the function at RSI to the table
+; IN: RSI = configuration space, EDX = segment and bus, CL = device and function
+pci_scan_add:
+	push rdi
+	push rcx
+	push rax
+	mov eax, 1
+	lock xadd [p_PCICount], eax	; EAX = index of the new entry
+	cmp eax, PCI_TABLE_MAX
+	jae pci_scan_add_done		; The table is full
+	imul edi, eax, PCI_ENTRY_SIZE
+	add rdi, [p_PCITable]
+	mov [rdi+PCI_ECAM], rsi
+	mov eax, edx
+	mov al, cl
+	mov [rdi+PCI_FUNCTION], eax	; Function, bus, and segment
+	mov eax, [rsi]
+	mov [rdi+PCI_VENDOR], eax	; Vendor ID and Device ID
+	mov eax, [rsi+0x08]
+	mov [rdi+PCI_CLASS], eax	; Revision ID and Class Code
+	mov al, [rsi+0x0E]
+	mov [rdi+PCI_HEADER], al	; Header Type
+	xor eax, eax
+	test byte [rsi+0x06], 0x10	; Status bit 4 is set if there is a capabilities list
+	jz pci_scan_add_caps
+	mov al, [rsi+0x34]		; Capabilities Pointer
+	and al, 0xFC
+pci_scan_add_caps:
+	mov [rdi+PCI_CAPS], al
+	mov al, [rsi+0x3D]
+	mov [rdi+PCI_IRQ_PIN], al	; Interrupt Pin
+	mov al, [rsi+0x3C]
+	mov [rdi+PCI_IRQ_LINE], al	; Interrupt Line
+	xor ecx, ecx
+pci_scan_add_bar:			; Copy the BARs with 32-bit reads
+	mov eax, [rsi+0x10+rcx*4]
+	mov [rdi+PCI_BAR+rcx*4], eax
+	inc ecx
+	cmp ecx, 6
+	jne pci_scan_add_bar
+pci_scan_add_done:
+	pop rax
+	pop rcx
+	pop rdi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; pci_sort -- Sort the device table by segment, bus, device, and function
+; The cores take buses in order, so an insertion sort has little to move.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+pci_sort:
+	push rsi
+	push rdi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	mov rbx, [p_PCITable]
+	mov edx, 1			; EDX = index of the entry to insert
+pci_sort_next:
+	cmp edx, [p_PCICount]
+	jae pci_sort_done
+	imul edi, edx, PCI_ENTRY_SIZE
+	add rdi, rbx			; RDI = entry to insert
+	mov eax, [rdi+PCI_FUNCTION]	; EAX = key
+	cmp [rdi+PCI_FUNCTION-PCI_ENTRY_SIZE], eax
+	jbe pci_sort_skip		; Already in order
+	sub rsp, PCI_ENTRY_SIZE		; Keep the entry on the stack
+	mov rsi, rdi
+	mov rdi, rsp
+	mov ecx, PCI_ENTRY_SIZE / 8
+	rep movsq
+	sub rsi, PCI_ENTRY_SIZE		; RSI = slot of the entry
+pci_sort_shift:
+	cmp rsi, rbx
+	je pci_sort_insert		; At the start of the table
+	cmp [rsi+PCI_FUNCTION-PCI_ENTRY_SIZE], eax
+	jbe pci_sort_insert
+	mov rdi, rsi			; Move the previous entry up by one
+	sub rsi, PCI_ENTRY_SIZE
+	mov ecx, PCI_ENTRY_SIZE / 8
+	rep movsq
+	sub rsi, PCI_ENTRY_SIZE
+	jmp pci_sort_shift
+pci_sort_insert:
+	mov rdi, rsi
+	mov rsi, rsp
+	mov ecx, PCI_ENTRY_SIZE / 8
+	rep movsq
+	add rsp, PCI_ENTRY_SIZE
+pci_sort_skip:
+	inc edx
+	jmp pci_sort_next
+
+pci_sort_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rdi
+	pop rsi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; PCI device table entry
+PCI_ECAM		equ 0x00	; DQ - Address of the configuration space
+PCI_FUNCTION		equ 0x08	; DB - Device (bits 7:3) and function (bits 2:0)
+PCI_BUS			equ 0x09	; DB - Bus
+PCI_SEGMENT		equ 0x0A	; DW - PCI Segment Group
+PCI_VENDOR		equ 0x0C	; DW - Vendor ID
+PCI_DEVICE		equ 0x0E	; DW - Device ID
+PCI_CLASS		equ 0x10	; DD - Revision ID, Prog IF, Subclass, and Class
+PCI_HEADER		equ 0x14	; DB - Header Type
+PCI_CAPS		equ 0x15	; DB - Capabilities Pointer, 0 if there is no list
+PCI_IRQ_PIN		equ 0x16	; DB - Interrupt Pin
+PCI_IRQ_LINE		equ 0x17	; DB - Interrupt Line
+PCI_BAR			equ 0x18	; 6 DD - The 6 registers from offset 0x10, the BARs of a type 0 header
+PCI_ENTRY_SIZE		equ 0x30
+
+PCI_TABLE_SIZE		equ 0x200000				; One 2MiB page
+PCI_TABLE_MAX		equ PCI_TABLE_SIZE / PCI_ENTRY_SIZE - 1	; Plus a blank record
+
+
+; =============================================================================
+; EOF
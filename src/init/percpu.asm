@@ -0,0 +1,269 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; INIT PERCPU - Give each CPU a stack and a data block above 1MiB, taken from
+; the memory of its own proximity domain when the SRAT lists it. This code is
+; called by the BSP after init_numa and before mem_map
+; =============================================================================
+
+
+init_percpu:
+; Clear the table. A CPU without an area uses a 1KiB stack below 640KiB
+	mov edi, IM_CPU_AREA
+	movzx ecx, word [p_cpu_detected]
+	xor eax, eax
+	rep stosq
+	mov [p_CPUStackSize], eax
+	mov [p_CPUDataSize], eax
+
+	movzx eax, byte [cfg_cpustack]
+	cmp eax, 0
+	je init_percpu_done		; Disabled
+	shl eax, 12
+	mov [p_CPUStackSize], eax
+	movzx eax, byte [cfg_cpudata]
+	cmp eax, 0
+	jne init_percpu_data
+	inc eax				; The data block needs at least one page
+init_percpu_data:
+	shl eax, 12
+	mov [p_CPUDataSize], eax
+	add eax, [p_CPUStackSize]
+	mov r12, rax			; R12 = size of each area
+
+	mov r13, 0x100000000		; Only the first 4GiB are identity mapped with 2MiB pages
+	mov eax, 0x80000001
+	cpuid
+	bt edx, 26			; 1GiB pages are supported if bit 26 is set
+	jnc init_percpu_limit
+	or r13, -1			; The identity map then covers all of RAM
+init_percpu_limit:
+
+	xor r14d, r14d			; R14 = index of the CPU
+init_percpu_next:
+	cmp r14w, [p_cpu_detected]
+	jae init_percpu_done
+	cmp qword [IM_CPU_AREA+r14*8], 0
+	jne init_percpu_skip		; Already given an area with the others in its domain
+	mov r15d, [IM_NUMA_CPU+r14*4]	; R15D = proximity domain of the CPU
+
+	; Count the CPUs in this domain. One block holds all of their areas
+	mov r8, r14
+	xor eax, eax
+init_percpu_count:
+	cmp [IM_NUMA_CPU+r8*4], r15d
+	jne init_percpu_count_next
+	inc eax
+init_percpu_count_next:
+	inc r8
+	cmp r8w, [p_cpu_detected]
+	jb init_percpu_count
+	mul r12
+	add rax, 0x1FFFFF		; Round up to a 2MiB page
+	and rax, -0x200000
+	mov rcx, rax
+	call init_percpu_alloc
+	jc init_percpu_skip		; No room, these CPUs use the low stacks
+
+	; Hand out the areas in CPU order. The stack is below the data block
+	mov r8, r14
+init_percpu_assign:
+	cmp [IM_NUMA_CPU+r8*4], r15d
+	jne init_percpu_assign_next
+	mov edx, [p_CPUStackSize]
+	add rax, rdx
+	mov [IM_CPU_AREA+r8*8], rax	; Address of the data block and top of the stack
+	mov edx, [p_CPUDataSize]
+	add rax, rdx
+init_percpu_assign_next:
+	inc r8
+	cmp r8w, [p_cpu_detected]
+	jb init_percpu_assign
+
+init_percpu_skip:
+	inc r14
+	jmp init_percpu_next
+
+init_percpu_done:
+	ret
+
+
+; -----------------------------------------------------------------------------
+; init_percpu_alloc -- Take a block from the free memory of a proximity domain
+; The highest fitting range of the domain is used, or of all free memory if the
+; domain is not known or has no room. The block is removed from both lists.
+;  IN:	RCX = Size of the block, a multiple of 2MiB
+;	R15D = Proximity domain
+;	R13 = Highest end address allowed
+; OUT:	RAX = Address of the block, 2MiB aligned
+;	Carry set if there was no room
+;	RBX, RDX, RSI, RDI, R9, R10, R11 are modified
+init_percpu_alloc:
+	xor ebx, ebx			; RBX = best range found
+	cmp r15d, 0xFFFFFFFF
+	je init_percpu_alloc_any
+	mov esi, IM_NUMA_MEM
+	movzx edx, word [p_NUMAMem]
+init_percpu_alloc_node:
+	cmp edx, 0
+	je init_percpu_alloc_node_done
+	cmp [rsi+16], r15d
+	jne init_percpu_alloc_node_next
+	call init_percpu_fit
+init_percpu_alloc_node_next:
+	add esi, 32
+	dec edx
+	jmp init_percpu_alloc_node
+init_percpu_alloc_node_done:
+	cmp rbx, 0
+	jne init_percpu_alloc_found
+
+init_percpu_alloc_any:
+	mov esi, IM_MEMEXTENTS
+	movzx edx, word [p_MemExtents]
+init_percpu_alloc_extent:
+	cmp edx, 0
+	je init_percpu_alloc_extent_done
+	call init_percpu_fit
+	add esi, 32
+	dec edx
+	jmp init_percpu_alloc_extent
+init_percpu_alloc_extent_done:
+	cmp rbx, 0
+	jne init_percpu_alloc_found
+	stc
+	ret
+
+init_percpu_alloc_found:
+	mov rax, r9
+	lea rdx, [rax+rcx]
+	push rcx
+	mov esi, IM_NUMA_MEM
+	mov edi, p_NUMAMem
+	mov ecx, IM_NUMA_MEM_MAX
+	call mem_reserve
+	mov esi, IM_MEMEXTENTS
+	mov edi, p_MemExtents
+	mov ecx, IM_MEMEXTENTS_MAX
+	call mem_reserve
+	pop rcx
+	clc
+	ret
+
+; Keep the range at RSI if the block fits at its first 2MiB page with some of it
+; left over, so the end of the last extent and the identity map do not change
+; IN:	RSI = range, RCX = size of the block, R13 = highest end address allowed
+; OUT:	RBX = RSI and R9 = address of the block if it fits
+init_percpu_fit:
+	mov rax, [rsi]
+	add rax, 0x1FFFFF
+	and rax, -0x200000
+	lea r10, [rax+rcx]
+	cmp r10, r13
+	ja init_percpu_fit_done
+	mov r11, [rsi]
+	add r11, [rsi+8]
+	cmp r10, r11
+	jae init_percpu_fit_done
+	mov rbx, rsi
+	mov r9, rax
+init_percpu_fit_done:
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; percpu_setup -- Clear the data block of this CPU and point GS base at it
+; Each CPU clears its own block so the pages are first touched locally.
+;  IN:	ECX = Index of this CPU in the CPU table
+; OUT:	Nothing, all registers preserved
+percpu_setup:
+	push rdi
+	push rdx
+	push rcx
+	push rax
+
+	mov rdi, [IM_CPU_AREA+rcx*8]
+	cmp rdi, 0
+	je percpu_setup_done		; This CPU is using a low stack
+	push rdi
+	mov edx, ecx			; EDX = index of the CPU
+	mov ecx, [p_CPUDataSize]
+	shr ecx, 3
+	xor eax, eax
+	rep stosq
+	mov ecx, edx
+	pop rdi
+	mov [rdi+PERCPU_SELF], rdi
+	mov [rdi+PERCPU_INDEX], ecx
+	mov eax, [IM_CPU_APICID+rcx*4]
+	mov [rdi+PERCPU_APICID], eax
+	mov eax, [IM_NUMA_CPU+rcx*4]
+	mov [rdi+PERCPU_DOMAIN], eax
+	mov eax, [p_CPUStackSize]
+	mov rdx, rdi
+	sub rdx, rax
+	mov [rdi+PERCPU_STACK], rdx
+	mov eax, edi
+	mov rdx, rdi
+	shr rdx, 32
+	mov ecx, 0xC0000101		; IA32_GS_BASE
+	wrmsr
+
+percpu_setup_done:
+	pop rax
+	pop rcx
+	pop rdx
+	pop rdi
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; percpu_mailbox_wait -- Wait for an AP to take the work written to its mailbox
+; Work the AP has not taken within MAILBOX_TIMEOUT is withdrawn, so a core that
+; stopped answering is not waited for.
+;  IN:	RSI = Data block of the AP
+; OUT:	Carry set if the work was withdrawn
+;	All other registers preserved
+percpu_mailbox_wait:
+	push rcx
+	push rax
+
+	mov ecx, MAILBOX_TIMEOUT
+percpu_mailbox_wait_next:
+	cmp qword [rsi+PERCPU_MAILBOX+MAILBOX_ENTRY], 0
+	je percpu_mailbox_wait_done	; Taken, carry is clear
+	pause
+	dec ecx
+	jnz percpu_mailbox_wait_next
+	xor eax, eax
+	xchg rax, [rsi+PERCPU_MAILBOX+MAILBOX_ENTRY]	; The AP takes it with XCHG too
+	neg rax				; Carry set if the work was still there
+
+percpu_mailbox_wait_done:
+	pop rax
+	pop rcx
+	ret
+; -----------------------------------------------------------------------------
+
+
+; Per-CPU data block
+PERCPU_SELF		equ 0x00	; DQ - Address of the data block
+PERCPU_INDEX		equ 0x08	; DD - Index of the CPU in the CPU table
+PERCPU_APICID		equ 0x0C	; DD - APIC ID
+PERCPU_DOMAIN		equ 0x10	; DD - Proximity domain, 0xFFFFFFFF if not known
+PERCPU_STACK		equ 0x18	; DQ - Lowest address of the stack
+PERCPU_TSC_OFFSET	equ 0x20	; DQ - TSC less the BSP TSC after tsc_sync, in ticks
+PERCPU_SCRUB_RATE	equ 0x28	; DD - MiB per second zeroed by mem_scrub, 0 if it did not run
+PERCPU_MAILBOX		equ 0x40	; 64 bytes - AP mailbox, in its own cache line
+
+; AP mailbox
+MAILBOX_ENTRY		equ 0x00	; DQ - Entry point, the AP calls it once it is not 0
+MAILBOX_ARGUMENT	equ 0x08	; DQ - Passed to the entry point in RDI
+MAILBOX_TIMEOUT		equ 10000000	; PAUSE loops to wait for an AP to take the work
+
+
+; =============================================================================
+; EOF
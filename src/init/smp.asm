@@ -7,123 +7,154 @@
 
 
 init_smp:
+%ifndef NO_SMP
 ; Check if we want the AP's to be enabled.. if not then skip to end
 	cmp byte [cfg_smpinit], 1	; Check if SMP should be enabled
 	jne noMP			; If not then skip SMP init
 
+; Wait 10us after INIT on CPUs newer than the Pentium 4 and K8, and 10ms on those
+	mov r9d, SMP_INIT_DELAY		; R9 holds the delay after INIT
+	mov eax, 1
+	cpuid
+	and eax, 0x0FF00F00		; Extended Family (Bits 27:20) and Family (Bits 11:8)
+	cmp eax, 0x00000F00
+	jne smp_init_delay_done
+	mov r9d, SMP_INIT_DELAY_OLD
+smp_init_delay_done:
+
+; Check if the AP's should all be started at once
+	cmp byte [cfg_smpbcast], 1	; Check if the broadcast shorthand should be used
+	je smp_broadcast
+
 ; Start the AP's one by one
-	xor eax, eax
-	xor edx, edx
-	mov rsi, [p_LocalAPICAddress]
-	mov eax, [rsi+0x20]		; Add the offset for the APIC ID location
-	shr rax, 24			; APIC ID is stored in bits 31:24
-	mov dl, al			; Store BSP APIC ID in DL
+	call apic_id
+	mov r8d, eax			; Store BSP APIC ID in R8D
 
-	mov esi, 0x00005100
+	mov esi, IM_CPU_APICID
 	xor eax, eax
 	xor ecx, ecx
 	mov cx, [p_cpu_detected]
 smp_send_INIT:
 	cmp cx, 0
 	je smp_send_INIT_done
-	lodsb
+	lodsd
 
-	cmp al, dl			; Is it the BSP?
+	cmp eax, r8d			; Is it the BSP?
 	je smp_send_INIT_skipcore
-
-	; Send 'INIT' IPI to APIC ID in AL
-	mov rdi, [p_LocalAPICAddress]
-	shl eax, 24
-	mov dword [rdi+0x310], eax	; Interrupt Command Register (ICR); bits 63-32
+	cmp eax, 0xFF			; Can this APIC ID be reached in xAPIC mode?
+	jb smp_send_INIT_core
+	cmp byte [p_x2APIC], 1
+	jne smp_send_INIT_skipcore
+
+smp_send_INIT_core:
+	; Send 'INIT' IPI to APIC ID in EAX
+	mov edx, eax
 	mov eax, 0x00004500
-	mov dword [rdi+0x300], eax	; Interrupt Command Register (ICR); bits 31-0
-smp_send_INIT_verify:
-	mov eax, [rdi+0x300]		; Interrupt Command Register (ICR); bits 31-0
-	bt eax, 12			; Verify that the command completed
-	jc smp_send_INIT_verify
+	call apic_send_ipi
 
 smp_send_INIT_skipcore:
-	dec cl
+	dec cx
 	jmp smp_send_INIT
 
 smp_send_INIT_done:
 
-	mov rax, [p_Counter_RTC]
-	add rax, 10
-smp_wait1:
-	mov rbx, [p_Counter_RTC]
-	cmp rax, rbx
-	jg smp_wait1
+	mov rax, r9
+	call timer_delay
 
-	mov esi, 0x00005100
+; Send the first SIPI to every core, then after SMP_SIPI_DELAY a second one to
+; the cores that have not checked in yet
+	xor r10d, r10d			; R10D is 0 for the first SIPI and 1 for the second
+smp_send_SIPI_all:
+	mov esi, IM_CPU_APICID
 	xor ecx, ecx
 	mov cx, [p_cpu_detected]
 smp_send_SIPI:
 	cmp cx, 0
 	je smp_send_SIPI_done
-	lodsb
+	lodsd
 
-	cmp al, dl			; Is it the BSP?
+	cmp eax, r8d			; Is it the BSP?
 	je smp_send_SIPI_skipcore
-
+	cmp eax, 0xFF			; Can this APIC ID be reached in xAPIC mode?
+	jb smp_send_SIPI_core
+	cmp byte [p_x2APIC], 1
+	jne smp_send_SIPI_skipcore
+
+smp_send_SIPI_core:
+	cmp r10d, 0
+	je smp_send_SIPI_send
+	lea edx, [esi-IM_CPU_APICID-4]
+	shr edx, 2			; EDX is the index of the core in the CPU table
+	cmp byte [IM_CPU_STATUS+rdx], 1
+	je smp_send_SIPI_skipcore	; It has already checked in
+
+smp_send_SIPI_send:
 	; Send 'Startup' IPI to destination using vector 0x08 to specify entry-point is at the memory-address 0x00008000
-	mov rdi, [p_LocalAPICAddress]
-	shl eax, 24
-	mov dword [rdi+0x310], eax	; Interrupt Command Register (ICR); bits 63-32
+	mov edx, eax
 	mov eax, 0x00004608		; Vector 0x08
-	mov dword [rdi+0x300], eax	; Interrupt Command Register (ICR); bits 31-0
-smp_send_SIPI_verify:
-	mov eax, [rdi+0x300]		; Interrupt Command Register (ICR); bits 31-0
-	bt eax, 12			; Verify that the command completed
-	jc smp_send_SIPI_verify
+	call apic_send_ipi
 
 smp_send_SIPI_skipcore:
-	dec cl
+	dec cx
 	jmp smp_send_SIPI
 
 smp_send_SIPI_done:
-
-; Let things settle (Give the AP's some time to finish)
-	mov rax, [p_Counter_RTC]
-	add rax, 20
-smp_wait2:
-	mov rbx, [p_Counter_RTC]
-	cmp rax, rbx
-	jg smp_wait2
+	cmp r10d, 0
+	jne smp_wait_arrival
+	inc r10d
+	mov eax, SMP_SIPI_DELAY
+	call timer_delay
+	jmp smp_send_SIPI_all
+
+; Start all of the AP's at once with the 'All Excluding Self' destination shorthand
+; Every AP in the system receives the IPI, AP's that are not in the MADT will park themselves
+smp_broadcast:
+	xor edx, edx			; Destination is ignored when a shorthand is used
+	mov eax, 0x000C4500		; INIT, Assert, Shorthand 'All Excluding Self' (Bits 19:18)
+	call apic_send_ipi
+
+	mov rax, r9
+	call timer_delay
+
+	mov eax, 0x000C4608		; Startup, Vector 0x08, Shorthand 'All Excluding Self'
+	call apic_send_ipi
+
+	mov eax, SMP_SIPI_DELAY
+	call timer_delay
+
+	mov eax, 0x000C4608		; Second Startup IPI. AP's that already started will ignore it
+	call apic_send_ipi
+
+; Wait for the AP's to check in. Each core increments p_cpu_activated at the end of init_cpu
+; Stop waiting once every detected core has arrived or the timeout has passed
+smp_wait_arrival:
+	mov ecx, SMP_ARRIVAL_TIMEOUT / 10
+	mov eax, 10
+smp_wait_arrival_check:
+	mov bx, [p_cpu_activated]
+	cmp bx, [p_cpu_detected]
+	jae noMP			; All of the cores have arrived
+	call timer_delay
+	dec ecx
+	jnz smp_wait_arrival_check
+%endif
 
 ; Finish up
 noMP:
-	xor eax, eax
-	mov rsi, [p_LocalAPICAddress]
-	add rsi, 0x20			; Add the offset for the APIC ID location
-	lodsd				; APIC ID is stored in bits 31:24
-	shr rax, 24			; AL now holds the CPU's APIC ID (0 - 255)
+	call apic_id			; EAX holds the CPU's APIC ID
 	mov [p_BSP], eax		; Store the BSP APIC ID
 
-; Calculate speed of CPU (At this point the RTC is firing at 1024Hz)
-	cpuid
-	xor edx, edx
-	xor eax, eax
-	mov rcx, [p_Counter_RTC]
-	add rcx, 10
-	rdtsc
-	push rax
-speedtest:
-	mov rbx, [p_Counter_RTC]
-	cmp rbx, rcx
-	jl speedtest
-	rdtsc
-	pop rdx
-	sub rax, rdx
-	xor edx, edx
-	mov rcx, 10240
-	div rcx
-	mov [p_cpu_speed], ax
-
 	cli				; Disable Interrupts
 
 	ret
 
 
+; Delays in microseconds
+SMP_INIT_DELAY		equ 10		; After INIT and before the first SIPI
+SMP_INIT_DELAY_OLD	equ 10000	; The same, for the Pentium 4 and K8
+SMP_SIPI_DELAY		equ 200		; Between the two SIPIs
+SMP_ARRIVAL_TIMEOUT	equ 20000	; Give up on cores that have not arrived by then
+
+
 ; =============================================================================
 ; EOF
@@ -68,7 +68,7 @@ startap32:
 	mov cr4, eax
 
 ; Point cr3 at PML4
-	mov eax, 0x00002008		; Write-thru (Bit 3)
+	mov eax, 0x00002000		; Write-back (PWT and PCD clear)
 	mov cr3, eax
 
 ; Enable long mode and SYSCALL/SYSRET
@@ -120,16 +120,70 @@ startap64:
 	jmp rax
 	nop
 clearcs64_ap:
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov r15, rax			; R15 = TSC when this AP arrived
 	xor eax, eax
 
-	; Reset the stack. Each CPU gets a 1024-byte unique stack location
-	mov rsi, [p_LocalAPICAddress]	; We would call p_smp_get_id here but the stack is not ...
+%ifndef NO_X2APIC
+	; Switch this core to x2APIC mode if the BSP is using it
+	cmp byte [p_x2APIC], 1
+	jne startap64_xapic
+	mov ecx, 0x0000001B		; APIC_BASE
+	rdmsr
+	bts eax, 11			; APIC Global Enable (Bit 11) must be set before EXTD
+	wrmsr
+	bts eax, 10			; x2APIC Enable (Bit 10)
+	wrmsr
+	mov ecx, 0x00000802		; x2APIC ID Register
+	rdmsr				; EAX holds the 32-bit x2APIC ID
+	jmp startap64_index
+%else
+	; Go back to xAPIC mode like the BSP if the firmware left x2APIC enabled
+	mov ecx, 0x0000001B		; APIC_BASE
+	rdmsr
+	btr eax, 10			; x2APIC Enable (Bit 10)
+	jnc startap64_xapic
+	btr eax, 11			; APIC Global Enable (Bit 11)
+	wrmsr
+	bts eax, 11
+	wrmsr
+%endif
+startap64_xapic:
+	mov rsi, [p_LocalAPICAddress]	; We would call apic_id here but the stack is not ...
 	add rsi, 0x20			; ... yet defined. It is safer to find the value directly.
 	lodsd				; Load a 32-bit value. We only want the high 8 bits
-	shr rax, 24			; Shift to the right and AL now holds the CPU's APIC ID
+	shr eax, 24			; Shift to the right and AL now holds the CPU's APIC ID
+
+	; Find the position of this CPU in the CPU table
+startap64_index:
+	mov rsi, IM_CPU_APICID
+	xor ecx, ecx
+	xor edx, edx
+	mov dx, [p_cpu_detected]
+startap64_index_next:
+	cmp ecx, edx
+	jae ap_park			; Not listed in the MADT so don't use this core
+	cmp eax, [rsi+rcx*4]
+	je startap64_index_found
+	inc ecx
+	jmp startap64_index_next
+startap64_index_found:
+	mov [IM_CPU_ARRIVAL+rcx*8], r15
+	mov rax, [IM_CPU_AREA+rcx*8]	; The stack ends at the data block
+	cmp rax, 0
+	jne startap64_stack
+	cmp ecx, 319			; The 1024-byte stacks must stay below the EBDA at 0x9FC00
+	jae ap_park
+
+	; No area for this CPU. It gets a 1024-byte unique stack location
+	mov eax, ecx
 	shl rax, 10			; shift left 10 bits for a 1024byte stack
 	add rax, 0x0000000000050400	; stacks decrement when you "push", start at 1024 bytes in
-	mov rsp, rax			; Pure64 leaves 0x50000-0x9FFFF free so we use that
+startap64_stack:
+	mov rsp, rax
+	call percpu_setup		; Clear the data block and set GS base
 
 	lgdt [GDTR64]			; Load the GDT
 	lidt [IDTR64]			; load IDT register
@@ -142,17 +196,74 @@ clearcs64_ap:
 ;	or eax, 0000000100000000b
 ;	stosd
 
+	push rcx
 	call init_cpu			; Setup CPU
+	pop rcx
 
 	sti				; Activate interrupts for SMP
-	jmp ap_sleep
+	mov rsi, [IM_CPU_AREA+rcx*8]
+	cmp rsi, 0
+	je ap_sleep			; No mailbox, the core can only be woken with an IPI
+	add rsi, PERCPU_MAILBOX
 
 
+; Wait for the payload to write an entry point to the mailbox at RSI. The entry
+; point is called with RDI holding the argument and RSI the mailbox, and the
+; core waits on the mailbox again if it returns
 align 16
 
+ap_mailbox:
+	lea rsp, [rsi-PERCPU_MAILBOX-8]	; Reset the stack, keeping the mailbox address
+	mov [rsp], rsi
+	mov eax, 1
+	cpuid
+	bt ecx, 3			; MONITOR/MWAIT is supported if bit 3 is set
+	jnc ap_mailbox_pause
+ap_mailbox_mwait:
+	mov rax, rsi
+	xor ecx, ecx
+	xor edx, edx
+	monitor				; Watch the cache line of the mailbox
+	cmp qword [rsi+MAILBOX_ENTRY], 0
+	jne ap_mailbox_run
+	movzx eax, byte [p_MWAITHint]	; C1 by default, wake on a write to the mailbox or an interrupt
+	mwait
+	jmp ap_mailbox_mwait
+ap_mailbox_pause:
+	pause
+	cmp qword [rsi+MAILBOX_ENTRY], 0
+	je ap_mailbox_pause
+ap_mailbox_run:
+	mov rdi, [rsi+MAILBOX_ARGUMENT]	; Written before the entry point
+	xor eax, eax
+	xchg rax, [rsi+MAILBOX_ENTRY]	; Let the payload know the work was taken
+	cmp rax, 0
+	je ap_mailbox			; It was withdrawn first
+	sub rsp, 8			; RSP+8 is 16-byte aligned at the entry point
+	call rax
+	mov rsi, [rsp+8]
+	jmp ap_mailbox
+
+
 ap_sleep:
+	test byte [p_PowerPolicy], POWER_CSTATE
+	jz ap_sleep_hlt
+ap_sleep_mwait:				; Nothing writes the stack line, so only an interrupt wakes the core
+	mov rax, rsp
+	xor ecx, ecx
+	xor edx, edx
+	monitor
+	movzx eax, byte [p_MWAITHint]	; The deepest C-state allowed by cfg_cstate
+	mwait
+	jmp ap_sleep_mwait
+ap_sleep_hlt:
 	hlt				; Suspend CPU until an interrupt is received. opcode for hlt is 0xF4
-	jmp ap_sleep			; just-in-case of an NMI
+	jmp ap_sleep_hlt		; just-in-case of an NMI
+
+ap_park:				; Cores that can't be used stay here with interrupts disabled
+	cli
+	hlt
+	jmp ap_park
 
 
 ; =============================================================================
@@ -0,0 +1,585 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; INIT TIMER - Start the HPET, find the TSC frequency, wait for a number of
+; microseconds, and synchronize the TSCs of the APs. This code is called by the
+; BSP. The RTC is only needed if neither CPUID nor the HPET gives the TSC
+; frequency. With NO_LEGACY_IRQ it is left unknown and delays assume a 6GHz
+; TSC. The boot timing table is also kept here
+; =============================================================================
+
+
+init_timer:
+; HPET - Enable the main counter if one was found in the ACPI tables
+	mov rsi, [p_HPETAddress]
+	cmp rsi, 0
+	je init_timer_hpet_done
+	mov eax, [rsi+HPET_GCAP_ID+4]	; Main counter tick period in femtoseconds
+	cmp eax, 0
+	je init_timer_hpet_done
+	cmp eax, HPET_PERIOD_MAX
+	ja init_timer_hpet_done		; Not a valid period
+	mov [p_HPETPeriod], eax
+	or dword [rsi+HPET_GEN_CONF], 1	; ENABLE_CNF (Bit 0)
+init_timer_hpet_done:
+
+; Check for an invariant TSC
+	mov eax, 0x80000000
+	cpuid
+	cmp eax, 0x80000007
+	jb init_timer_invariant_done
+	mov eax, 0x80000007
+	cpuid
+	bt edx, 8			; Invariant TSC
+	jnc init_timer_invariant_done
+	mov byte [p_TSCInvariant], 1
+init_timer_invariant_done:
+
+	xor eax, eax
+	cpuid
+	mov r8d, eax			; R8D holds the highest standard CPUID leaf
+
+; CPUID leaf 0x15 - TSC = crystal * numerator / denominator
+	cmp r8d, 0x15
+	jb init_timer_cpuid16
+	mov eax, 0x15
+	cpuid
+	cmp eax, 0
+	je init_timer_cpuid16		; No ratio
+	cmp ebx, 0
+	je init_timer_cpuid16
+	cmp ecx, 0
+	je init_timer_cpuid16		; The crystal frequency is not listed
+	mov r9d, eax
+	mov eax, ecx
+	mul rbx				; RAX = crystal * numerator
+	div r9				; RAX = TSC Hz
+	mov byte [p_TSCSource], 1
+	jmp init_timer_save
+
+; CPUID leaf 0x16 - TSC runs at the base frequency
+init_timer_cpuid16:
+	cmp r8d, 0x16
+	jb init_timer_hpet
+	mov eax, 0x16
+	cpuid
+	and eax, 0xFFFF			; Base frequency in MHz
+	cmp eax, 0
+	je init_timer_hpet
+	mov ecx, 1000000
+	mul rcx				; RAX = TSC Hz
+	mov byte [p_TSCSource], 2
+	jmp init_timer_save
+
+; HPET - Count TSC ticks over 1ms of the HPET main counter
+init_timer_hpet:
+	mov rsi, [p_HPETAddress]
+	mov r9d, [p_HPETPeriod]
+	cmp r9d, 0
+	je init_timer_rtc
+	mov rax, 1000000000000		; 1ms in femtoseconds
+	xor edx, edx
+	div r9
+	mov r10, rax			; R10 = HPET ticks in 1ms
+	mov ebx, [rsi+HPET_MAIN_CNT]
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov rcx, rax			; RCX = starting TSC
+	mov edi, 1000000		; Give up if the HPET does not count
+init_timer_hpet_wait:
+	dec edi
+	jz init_timer_hpet_dead
+	mov eax, [rsi+HPET_MAIN_CNT]
+	sub eax, ebx			; 32-bit difference handles a 32-bit counter wrapping
+	cmp rax, r10
+	jb init_timer_hpet_wait
+	mov r11, rax			; R11 = HPET ticks that passed
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, rcx			; RAX = TSC ticks that passed
+	mov rcx, 1000000000000000	; Femtoseconds in one second
+	mul rcx
+	imul r11, r9			; R11 = femtoseconds that passed
+	div r11				; RAX = TSC Hz
+	mov byte [p_TSCSource], 3
+	jmp init_timer_save
+
+; RTC - Count TSC ticks over 10 ticks of the 1024Hz RTC
+init_timer_hpet_dead:
+	mov dword [p_HPETPeriod], 0	; Do not use it for delays
+init_timer_rtc:
+%ifdef NO_LEGACY_IRQ
+	xor eax, eax			; Nothing to measure it with, TSC_FREQ is left as 0
+%else
+	call init_pic			; Make sure the RTC is running
+	mov rcx, [p_Counter_RTC]
+	add rcx, 10
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov rbx, rax
+init_timer_rtc_wait:
+	cmp [p_Counter_RTC], rcx
+	jl init_timer_rtc_wait
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, rbx
+	shl rax, 10			; Multiply by 1024 and divide by 10
+	xor edx, edx
+	mov ecx, 10
+	div rcx
+	mov byte [p_TSCSource], 4
+%endif
+
+init_timer_save:
+	mov [p_TSCFrequency], rax
+	xor edx, edx
+	mov ecx, 1000000
+	div rcx
+	mov [p_cpu_speed], ax		; Speed in MHz
+
+	ret
+
+
+; -----------------------------------------------------------------------------
+; timer_delay -- Wait for a number of microseconds
+; Uses the HPET main counter if it is running, otherwise the TSC
+;  IN:	RAX = Number of microseconds
+; OUT:	All registers preserved
+timer_delay:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	mov ecx, [p_HPETPeriod]
+	cmp ecx, 0
+	je timer_delay_tsc
+	mov rsi, [p_HPETAddress]
+	mov ebx, 1000000000		; Femtoseconds in one microsecond
+	mul rbx
+	div rcx				; RAX = HPET ticks to wait
+	mov rcx, rax
+	mov ebx, [rsi+HPET_MAIN_CNT]
+timer_delay_hpet:
+	pause
+	mov eax, [rsi+HPET_MAIN_CNT]
+	sub eax, ebx			; 32-bit difference handles a 32-bit counter wrapping
+	cmp rax, rcx
+	jb timer_delay_hpet
+	jmp timer_delay_done
+
+timer_delay_tsc:
+	mov rcx, [p_TSCFrequency]
+%ifdef NO_LEGACY_IRQ
+	test rcx, rcx
+	jnz timer_delay_tsc_known
+	mov rcx, 6000000000		; Not known. 6GHz is above any current TSC, so delays only get longer
+timer_delay_tsc_known:
+%endif
+	mul rcx
+	mov ecx, 1000000
+	div rcx				; RAX = TSC ticks to wait
+	mov rcx, rax
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov rbx, rax
+timer_delay_tsc_wait:
+	pause
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, rbx
+	cmp rax, rcx
+	jb timer_delay_tsc_wait
+
+timer_delay_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+; -----------------------------------------------------------------------------
+
+
+%ifndef NO_SMP
+; -----------------------------------------------------------------------------
+; tsc_sync -- Measure the TSC of every AP against the BSP and correct it
+; Each AP with a mailbox is sent tsc_sync_ap and the two cores ping-pong on
+; p_TSCSyncState. The round trip with the shortest time gives the offset and its
+; error bound. An offset past the bound is removed with IA32_TSC_ADJUST if the
+; AP has it, and the residual is measured again and saved in its data block.
+; p_TSCSync is set if no AP is left with a measurable offset.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+tsc_sync:
+	push rdi
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	push r8
+	push r9
+
+	xor edi, edi			; EDI = 1 if IA32_TSC_ADJUST is supported
+	xor eax, eax
+	cpuid
+	cmp eax, 7
+	jb tsc_sync_start
+	mov eax, 7
+	xor ecx, ecx
+	cpuid
+	bt ebx, 1			; IA32_TSC_ADJUST is supported if bit 1 is set
+	adc edi, 0
+tsc_sync_start:
+	mov byte [p_TSCSync], 1
+	call cpu_index
+	mov r8d, ecx			; R8D = index of the BSP
+	xor r9d, r9d			; R9D = index of the AP
+tsc_sync_next:
+	cmp r9w, [p_cpu_detected]
+	jae tsc_sync_done
+	cmp r9d, r8d
+	je tsc_sync_skip
+	cmp byte [IM_CPU_STATUS+r9], 1
+	jne tsc_sync_skip		; Not activated
+	mov rsi, [IM_CPU_AREA+r9*8]
+	cmp rsi, 0
+	je tsc_sync_unknown		; No mailbox to reach it with
+
+	; Hand the AP the sync code and wait for it to be taken
+	mov dword [p_TSCSyncState], TSC_SYNC_IDLE
+	mov rax, tsc_sync_ap
+	mov [rsi+PERCPU_MAILBOX+MAILBOX_ENTRY], rax
+	mov ecx, TSC_SYNC_TIMEOUT
+tsc_sync_wait_ap:
+	pause
+	cmp qword [rsi+PERCPU_MAILBOX+MAILBOX_ENTRY], 0
+	je tsc_sync_measure_offset
+	dec ecx
+	jnz tsc_sync_wait_ap
+	mov qword [rsi+PERCPU_MAILBOX+MAILBOX_ENTRY], 0
+	jmp tsc_sync_unknown
+
+tsc_sync_measure_offset:
+	call tsc_sync_measure		; RAX = offset, RDX = error bound
+	mov rbx, rax
+	mov rcx, rax
+	neg rcx
+	cmovs rcx, rbx			; RCX = |offset|
+	cmp rcx, rdx
+	jbe tsc_sync_residual		; Can not be told apart from 0
+	cmp edi, 0
+	je tsc_sync_residual_measured	; No IA32_TSC_ADJUST to correct it with
+	mov dword [p_TSCSyncState], TSC_SYNC_ADJUST	; The AP subtracts p_TSCSyncOffset
+tsc_sync_wait_adjust:
+	pause
+	cmp dword [p_TSCSyncState], TSC_SYNC_IDLE
+	jne tsc_sync_wait_adjust
+	call tsc_sync_measure
+
+tsc_sync_residual_measured:
+	mov rbx, rax
+	mov rcx, rax
+	neg rcx
+	cmovs rcx, rbx
+	cmp rcx, rdx
+	jbe tsc_sync_residual
+	mov byte [p_TSCSync], 0		; This AP is still off by more than the bound
+tsc_sync_residual:
+	mov [rsi+PERCPU_TSC_OFFSET], rax
+
+	mov dword [p_TSCSyncState], TSC_SYNC_DONE
+tsc_sync_wait_done:
+	pause
+	cmp dword [p_TSCSyncState], TSC_SYNC_IDLE
+	jne tsc_sync_wait_done
+	jmp tsc_sync_skip
+
+tsc_sync_unknown:
+	mov byte [p_TSCSync], 0
+tsc_sync_skip:
+	inc r9d
+	jmp tsc_sync_next
+
+tsc_sync_done:
+	pop r9
+	pop r8
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	pop rdi
+	ret
+
+
+; Ping-pong with the AP for a number of rounds
+; OUT:	RAX = TSC of the AP less the TSC of the BSP, also in p_TSCSyncOffset
+;	RDX = Error bound, half of the shortest round trip
+;	RBX and RCX are modified
+tsc_sync_measure:
+	push r10
+	push r11
+	push r12
+	or r11, -1			; R11 = shortest round trip
+	mov r12d, TSC_SYNC_ROUNDS
+tsc_sync_measure_round:
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov rbx, rax			; RBX = BSP TSC before
+	mov dword [p_TSCSyncState], TSC_SYNC_PING
+tsc_sync_measure_wait:
+	pause
+	cmp dword [p_TSCSyncState], TSC_SYNC_PONG
+	jne tsc_sync_measure_wait
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov rcx, rax
+	sub rcx, rbx			; RCX = round trip
+	cmp rcx, r11
+	jae tsc_sync_measure_next
+	mov r11, rcx
+	shr rcx, 1
+	add rbx, rcx			; BSP TSC in the middle of the round trip
+	mov r10, [p_TSCSyncTSC]
+	sub r10, rbx			; R10 = offset of the best round
+tsc_sync_measure_next:
+	dec r12d
+	jnz tsc_sync_measure_round
+	mov rax, r10
+	mov [p_TSCSyncOffset], rax
+	mov rdx, r11
+	shr rdx, 1
+	pop r12
+	pop r11
+	pop r10
+	ret
+; -----------------------------------------------------------------------------
+
+
+; -----------------------------------------------------------------------------
+; tsc_sync_ap -- The AP side of tsc_sync, called through the mailbox
+;  IN:	Nothing
+; OUT:	All registers except RSP may be modified
+tsc_sync_ap:
+	mov eax, [p_TSCSyncState]
+	cmp eax, TSC_SYNC_PING
+	je tsc_sync_ap_pong
+	cmp eax, TSC_SYNC_ADJUST
+	je tsc_sync_ap_adjust
+	cmp eax, TSC_SYNC_DONE
+	je tsc_sync_ap_done
+	pause
+	jmp tsc_sync_ap
+tsc_sync_ap_pong:
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov [p_TSCSyncTSC], rax
+	mov dword [p_TSCSyncState], TSC_SYNC_PONG
+	jmp tsc_sync_ap
+tsc_sync_ap_adjust:
+	mov ecx, 0x0000003B		; IA32_TSC_ADJUST
+	rdmsr
+	shl rdx, 32
+	or rax, rdx
+	sub rax, [p_TSCSyncOffset]	; Moves the TSC back by the offset
+	mov rdx, rax
+	shr rdx, 32
+	wrmsr
+	mov dword [p_TSCSyncState], TSC_SYNC_IDLE
+	jmp tsc_sync_ap
+tsc_sync_ap_done:
+	mov dword [p_TSCSyncState], TSC_SYNC_IDLE
+	ret
+; -----------------------------------------------------------------------------
+%endif
+
+
+; -----------------------------------------------------------------------------
+; timing_stamp -- Record the TSC in the boot timing table
+;  IN:	ECX = Offset of the entry in IM_TIMING
+; OUT:	Nothing, all registers preserved
+timing_stamp:
+	push rdx
+	push rax
+	rdtsc
+	mov [IM_TIMING+rcx], eax
+	mov [IM_TIMING+rcx+4], edx
+	pop rax
+	pop rdx
+	ret
+; -----------------------------------------------------------------------------
+
+%ifdef BOOT_TIMING
+
+; -----------------------------------------------------------------------------
+; timing_dump -- Send the time taken by each stage to the serial port
+; Stages that did not run are skipped. The last AP is timed from init_smp.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+timing_dump:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+
+	mov esi, timing_stages
+timing_dump_next:
+	movzx ebx, byte [rsi]
+	cmp bl, 0xFF
+	je timing_dump_ap
+	movzx ecx, byte [rsi+1]
+	add esi, 2
+	mov rax, [IM_TIMING+rbx]
+	mov rdx, [IM_TIMING+rcx]
+	test rax, rax
+	jz timing_dump_skip
+	test rdx, rdx
+	jz timing_dump_skip
+	sub rdx, rax
+	mov rax, rdx
+	call timing_line
+timing_dump_skip:
+	add esi, 8
+	jmp timing_dump_next
+
+timing_dump_ap:
+	xor eax, eax			; RAX = TSC of the last AP to arrive
+	xor ecx, ecx
+timing_dump_ap_next:
+	cmp cx, [p_cpu_detected]
+	jae timing_dump_ap_found
+	mov rdx, [IM_CPU_ARRIVAL+rcx*8]
+	cmp rdx, rax
+	cmova rax, rdx
+	inc ecx
+	jmp timing_dump_ap_next
+timing_dump_ap_found:
+	test rax, rax
+	jz timing_dump_done		; No AP arrived
+	sub rax, [IM_TIMING+TIMING_SMP]
+	jae timing_dump_ap_line
+	xor eax, eax			; The AP TSC was behind the BSP before tsc_sync
+timing_dump_ap_line:
+	mov esi, timing_name_ap
+	call timing_line
+
+timing_dump_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+
+; Send a line with the 8 character name at RSI and the RAX ticks in microseconds
+timing_line:
+	push rsi
+	push rdx
+	push rcx
+	push rbx
+	push rax
+	mov rbx, rax
+	mov al, 10
+	call timing_putc
+	mov ecx, 8
+timing_line_name:
+	lodsb
+	call timing_putc
+	dec ecx
+	jnz timing_line_name
+	mov rax, rbx
+	mov esi, timing_unit_ticks
+	mov rcx, [p_TSCFrequency]
+	test rcx, rcx
+	jz timing_line_value		; The frequency is not known, keep the ticks
+	mov edx, 1000000
+	mul rdx
+	div rcx
+	mov esi, timing_unit_us
+timing_line_value:
+	mov ebx, 10			; Push the decimal digits, lowest first
+	xor ecx, ecx
+timing_line_digit:
+	xor edx, edx
+	div rbx
+	push rdx
+	inc ecx
+	test rax, rax
+	jnz timing_line_digit
+timing_line_digit_out:
+	pop rax
+	add al, '0'
+	call timing_putc
+	dec ecx
+	jnz timing_line_digit_out
+timing_line_unit:
+	lodsb
+	test al, al
+	jz timing_line_done
+	call timing_putc
+	jmp timing_line_unit
+timing_line_done:
+	pop rax
+	pop rbx
+	pop rcx
+	pop rdx
+	pop rsi
+	ret
+
+; Send the character in AL to the serial port
+timing_putc:
+	push rdx
+	push rax
+	mov dx, 0x03F8 + 5		; Line Status Register
+timing_putc_wait:
+	in al, dx
+	test al, 0x20
+	jz timing_putc_wait
+	pop rax
+	mov dx, 0x03F8
+	out dx, al
+	pop rdx
+	ret
+; -----------------------------------------------------------------------------
+
+%endif
+
+
+; TSC sync states
+TSC_SYNC_IDLE		equ 0		; Waiting for the BSP
+TSC_SYNC_PING		equ 1		; The BSP read its TSC, the AP reads its own
+TSC_SYNC_PONG		equ 2		; The AP saved its TSC in p_TSCSyncTSC
+TSC_SYNC_ADJUST		equ 3		; The AP subtracts p_TSCSyncOffset with IA32_TSC_ADJUST
+TSC_SYNC_DONE		equ 4		; The AP returns to its mailbox
+TSC_SYNC_ROUNDS		equ 16
+TSC_SYNC_TIMEOUT	equ 10000000	; PAUSE loops to wait for an AP to take the mailbox
+
+
+; HPET registers
+HPET_GCAP_ID		equ 0x00
+HPET_GEN_CONF		equ 0x10
+HPET_MAIN_CNT		equ 0xF0
+HPET_PERIOD_MAX		equ 0x05F5E100	; 100ns is the longest period allowed
+
+
+; =============================================================================
+; EOF
@@ -0,0 +1,153 @@
+; =============================================================================
+; Pure64 -- a 64-bit OS/software loader written in Assembly for x86-64 systems
+; Copyright (C) 2008-2024 Return Infinity -- see LICENSE.TXT
+;
+; INIT VIDEO - Set a VBE graphics mode via the BIOS. This code is called by the
+; BSP in 32-bit mode after payload_load and before the low memory is cleared
+; =============================================================================
+
+
+BITS 32
+
+; -----------------------------------------------------------------------------
+; init_video -- Pick a mode from the VBE controller mode list and set it
+; Only the listed modes are queried. Of those with a linear frame buffer and
+; cfg_video_depth bits per pixel, the largest that fits in cfg_video_x by
+; cfg_video_y is used, or the smallest if none fit. VBEModeInfoBlock is left
+; clear if there is no such mode or cfg_video is 0. The mode list is read
+; into the bounce buffer, which is free once the payload has been moved. With
+; NO_VIDEO defined only the block is cleared.
+;  IN:	Nothing
+; OUT:	Nothing, all registers preserved
+init_video:
+	pushad
+	mov al, [0x8005]
+	cmp al, 'B'
+	je init_video_clear
+	cmp al, 'P'
+	jne init_video_done		; The loader set the video mode, if any
+init_video_clear:
+	mov edi, VBEModeInfoBlock
+	xor eax, eax
+	mov ecx, 64
+	rep stosd			; No frame buffer unless a mode is set
+%ifndef NO_VIDEO
+	cmp byte [cfg_video], 0
+	je init_video_done		; Headless
+	lgdt [GDTR32]			; Pure64 GDT with the 16-bit descriptors
+	jmp 0x18:init_video_16		; 16-bit protected mode
+
+BITS 16
+init_video_16:
+	mov ax, 0x20
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	mov eax, cr0
+	and al, 0xFE			; Clear protected mode bit
+	mov cr0, eax
+	jmp 0x0000:init_video_rm
+
+init_video_rm:
+	xor ax, ax
+	mov ds, ax
+	mov ss, ax
+	mov ax, PAYLOAD_BOUNCE >> 4
+	mov es, ax
+	sti
+	xor di, di
+	mov dword [es:di], 'VBE2'	; Ask for the VBE 2.0 controller information
+	mov ax, 0x4F00			; GET SuperVGA INFORMATION - http://www.ctyme.com/intr/rb-0273.htm
+	int 0x10
+	cmp ax, 0x004F
+	jne init_video_rm_done
+	lfs si, [es:14]			; FS:SI points to the mode list
+	xor ebx, ebx			; EBX = score of the best mode so far
+	xor bp, bp			; BP = best mode
+
+init_video_next:
+	mov cx, [fs:si]
+	add si, 2
+	cmp cx, 0xFFFF
+	je init_video_set		; End of the list
+	pushad
+	mov ax, 0x4F01			; GET SuperVGA MODE INFORMATION - http://www.ctyme.com/intr/rb-0274.htm
+	mov di, 0x200			; After the controller information
+	int 0x10
+	cmp ax, 0x004F
+	popad				; Flags are kept
+	jne init_video_next
+	mov ax, [es:0x200]		; ModeAttributes
+	and ax, 0x0091			; Supported, graphics, and linear frame buffer
+	cmp ax, 0x0091
+	jne init_video_next
+	mov al, [es:0x200+25]		; BitsPerPixel
+	cmp al, [cfg_video_depth]
+	jne init_video_next
+	movzx eax, word [es:0x200+18]	; XResolution
+	movzx edx, word [es:0x200+20]	; YResolution
+	cmp ax, [cfg_video_x]
+	ja init_video_large
+	cmp dx, [cfg_video_y]
+	ja init_video_large
+	imul eax, edx
+	add eax, 0x40000000		; A mode that fits scores above any that does not
+	jmp init_video_score
+init_video_large:
+	imul eax, edx
+	neg eax
+	add eax, 0x40000000		; The smaller the better
+init_video_score:
+	cmp eax, ebx
+	jbe init_video_next
+	mov ebx, eax
+	mov bp, cx
+	jmp init_video_next
+
+init_video_set:
+	test ebx, ebx
+	jz init_video_rm_done		; No mode matched
+	xor ax, ax
+	mov es, ax
+	mov di, VBEModeInfoBlock
+	mov cx, bp
+	mov ax, 0x4F01			; Keep the information for the chosen mode
+	int 0x10
+	mov bx, bp
+	or bx, 0x4000			; Use linear/flat frame buffer model (set bit 14)
+	mov ax, 0x4F02			; SET SuperVGA VIDEO MODE - http://www.ctyme.com/intr/rb-0275.htm
+	int 0x10
+	cmp ax, 0x004F
+	je init_video_rm_done
+	xor ax, ax			; The mode was not set
+	mov di, VBEModeInfoBlock
+	mov cx, 128
+	rep stosw
+
+init_video_rm_done:
+	cli
+	mov eax, cr0
+	or al, 0x01			; Set protected mode bit
+	mov cr0, eax
+	jmp 8:init_video_pm
+
+BITS 32
+init_video_pm:
+	mov eax, 16
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov ss, ax
+%endif
+
+init_video_done:
+	popad
+	ret
+; -----------------------------------------------------------------------------
+
+
+BITS 64
+
+
+; =============================================================================
+; EOF
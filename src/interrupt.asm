@@ -23,6 +23,7 @@ interrupt_gate:				; handler for all other interrupts
 ; -----------------------------------------------------------------------------
 
 
+%ifndef NO_LEGACY_IRQ
 ; -----------------------------------------------------------------------------
 ; Keyboard interrupt. IRQ 0x01, INT 0x21
 ; This IRQ runs whenever there is input on the keyboard
@@ -81,6 +82,7 @@ rtc:
 	pop rdi
 	iretq
 ; -----------------------------------------------------------------------------
+%endif
 
 
 ; -----------------------------------------------------------------------------
@@ -6,26 +6,57 @@
 ; while the BIOS or UEFI is still available and load the Pure64 binary to
 ; 0x00008000. Setup a minimal 64-bit environment, copy the 64-bit kernel from
 ; the end of the Pure64 binary to the 1MiB memory mark and jump to it.
+; The BIOS, PXE, and Multiboot loaders start Pure64 at 0x8000 in 32-bit
+; protected mode. The UEFI loader starts it at 0x8008 in 64-bit mode.
 ;
 ; Pure64 requires a payload for execution! The stand-alone pure64.sys file
 ; is not sufficient. You must append your kernel or software to the end of
-; the Pure64 binary. The maximum size of the kernel or software is 28KiB.
+; the Pure64 binary. Without a payload header the maximum size of the kernel
+; or software is 32KiB minus the size of pure64.sys and it is run at the
+; 1MiB mark.
 ;
 ; Windows - copy /b pure64.sys + kernel64.sys
 ; Unix - cat pure64.sys kernel64.sys > pure64.sys
 ; Max size of the resulting pure64.sys is 32768 bytes (32KiB)
+;
+; A larger payload starts with a 32 byte header (see PAYLOAD_HEADER in
+; sysvar.asm) that gives its size, load address, and entry point. It is copied
+; to its load address by the UEFI loader, or by Pure64 from the rest of the
+; file after what the MBR read, or from memory when booted via PXE. An LZ4
+; compressed payload is staged after its load address and Pure64 decompresses
+; it in 64-bit mode.
 ; =============================================================================
 
 
 BITS 32
 ORG 0x00008000
-PURE64SIZE equ 4096			; Pad Pure64 to this length
+%ifndef PURE64SIZE
+PURE64SIZE equ 16384			; Pad Pure64 to this length, in every profile
+%endif
+
+; Subsystems are left out of the build with NO_SMP, NO_VIDEO, NO_SERIAL,
+; NO_LEGACY_IRQ, NO_SCRUB, NO_PCI, and NO_X2APIC. See build.sh for the profiles
+%ifdef BOOT_TIMING
+%ifdef NO_SERIAL
+%error "BOOT_TIMING sends the timing table to the serial port"
+%endif
+%endif
 
 start:
-	jmp start32			; This command will be overwritten with 'NOP's before the AP's are started
+	jmp near start32		; This command will be overwritten with 'NOP's before the AP's are started
 	nop
+%if ($-$$) != 6
+%error "The '64' marker must be at 0x8006"
+%endif
 	db 0x36, 0x34			; '64' marker
+BITS 64
+%if ($-$$) != 8
+%error "The 64-bit entry point must be at 0x8008"
+%endif
+	jmp near start64_uefi		; 64-bit entry point at 0x8008 for the UEFI loader, also overwritten
+	times 16-($-$$) db 0x90
 
+%ifndef NO_SMP
 ; =============================================================================
 ; Code for AP startup
 BITS 16
@@ -45,6 +76,7 @@ BITS 16
 	mov esp, 0x8000			; Set a known free location for the stack
 
 %include "init/smp_ap.asm"		; AP's will start execution at 0x8000 and fall through to this code
+%endif
 
 ; =============================================================================
 ; 32-bit mode
@@ -62,6 +94,29 @@ start32:
 	mov ecx, 960			; 3840 bytes (Range is 0x5000 - 0x5EFF)
 	rep stosd			; Don't overwrite the VBE data at 0x5F00
 
+	rdtsc				; Start of Pure64
+	mov [IM_TIMING+TIMING_START], eax
+	mov [IM_TIMING+TIMING_START+4], edx
+	cmp byte [0x8005], 'B'
+	jne start32_timing
+	mov esi, MBR_TIMING		; The MBR pushed its timestamps in reverse order
+	mov edi, IM_TIMING+TIMING_READ
+	movsd
+	movsd
+	mov edi, IM_TIMING+TIMING_E820
+	movsd
+	movsd
+start32_timing:
+
+	movzx eax, word [0x040E]	; Save the EBDA address before the BIOS data area is cleared
+	shl eax, 4
+	cmp eax, 0x00080000
+	jb start32_ebda			; Not a valid EBDA address, it is not used
+	cmp eax, 0x000A0000
+	jae start32_ebda
+	mov [p_EBDAAddress], eax
+start32_ebda:
+
 	xor eax, eax			; Clear all registers
 	xor ebx, ebx
 	xor ecx, ecx
@@ -71,61 +126,19 @@ start32:
 	xor ebp, ebp
 	mov esp, 0x8000			; Set a known free location for the stack
 
-; Set up RTC
-; Port 0x70 is RTC Address, and 0x71 is RTC Data
-; http://www.nondot.org/sabre/os/files/MiscHW/RealtimeClockFAQ.txt
-rtc_poll:
-	mov al, 0x0A			; Status Register A
-	out 0x70, al			; Select the address
-	in al, 0x71			; Read the data
-	test al, 0x80			; Is there an update in process?
-	jne rtc_poll			; If so then keep polling
-	mov al, 0x0A			; Status Register A
-	out 0x70, al			; Select the address
-	mov al, 00100110b		; UIP (0), RTC@32.768KHz (010), Rate@1024Hz (0110)
-	out 0x71, al			; Write the data
-
-; Remap PIC IRQ's
-	mov al, 00010001b		; begin PIC 1 initialization
-	out 0x20, al
-	mov al, 00010001b		; begin PIC 2 initialization
-	out 0xA0, al
-	mov al, 0x20			; IRQ 0-7: interrupts 20h-27h
-	out 0x21, al
-	mov al, 0x28			; IRQ 8-15: interrupts 28h-2Fh
-	out 0xA1, al
-	mov al, 4
-	out 0x21, al
-	mov al, 2
-	out 0xA1, al
-	mov al, 1
-	out 0x21, al
-	out 0xA1, al
-
-; Mask all PIC interrupts
-	mov al, 0xFF
-	out 0x21, al
-	out 0xA1, al
-
-; Configure serial port @ 0x03F8
-	mov dx, 0x03F8 + 1		; Interrupt Enable
-	mov al, 0x00			; Disable all interrupts
-	out dx, al
-	mov dx, 0x03F8 + 3		; Line Control
-	mov al, 80
-	out dx, al
-	mov dx, 0x03F8 + 0		; Divisor Latch
-	mov ax, 1			; 1 = 115200 baud
-	out dx, ax
-	mov dx, 0x03F8 + 3		; Line Control
-	mov al, 3			; 8 bits, no parity, one stop bit
-	out dx, al
-	mov dx, 0x03F8 + 4		; Modem Control
-	mov al, 3
-	out dx, al
-	mov al, 0xC7			; Enable FIFO, clear them, with 14-byte threshold
-	mov dx, 0x03F8 + 2
-	out dx, al
+	rdtsc
+	mov [IM_TIMING+TIMING_LOAD], eax
+	mov [IM_TIMING+TIMING_LOAD+4], edx
+	call payload_load		; Move the payload before the BIOS state and low memory are changed
+	rdtsc
+	mov [IM_TIMING+TIMING_LOAD+8], eax
+	mov [IM_TIMING+TIMING_LOAD+12], edx
+	mov [IM_TIMING+TIMING_VBE], eax
+	mov [IM_TIMING+TIMING_VBE+4], edx
+	call init_video			; Set the graphics mode while the BIOS can still be used
+	rdtsc
+	mov [IM_TIMING+TIMING_PAGING], eax
+	mov [IM_TIMING+TIMING_PAGING+4], edx
 
 ; Clear out the first 20KiB of memory. This will store the 64-bit IDT, GDT, PML4, PDP Low, and PDP High
 	mov ecx, 5120
@@ -184,7 +197,7 @@ create_pdpte_low:
 ; A single PDE can map 2MiB of RAM
 ; A single PDE is 8 bytes in length
 	mov edi, 0x00010000		; Location of first PDE
-	mov eax, 0x0000008F		; Bits 0 (P), 1 (R/W), 2 (U/S), 3 (PWT), and 7 (PS) set
+	mov eax, 0x00000187		; Bits 0 (P), 1 (R/W), 2 (U/S), 7 (PS), and 8 (G) set
 	xor ecx, ecx
 pde_low:				; Create a 2 MiB page
 	stosd
@@ -206,7 +219,7 @@ pde_low:				; Create a 2 MiB page
 	mov cr4, eax
 
 ; Point cr3 at PML4
-	mov eax, 0x00002008		; Write-thru enabled (Bit 3)
+	mov eax, 0x00002000		; Write-back (PWT and PCD clear)
 	mov cr3, eax
 
 ; Enable long mode and SYSCALL/SYSRET
@@ -223,12 +236,131 @@ pde_low:				; Create a 2 MiB page
 	jmp SYS64_CODE_SEL:start64	; Jump to 64-bit mode
 
 
-align 16
-
 ; =============================================================================
 ; 64-bit mode
 BITS 64
 
+; The UEFI loader jumps here in the long mode set up by the firmware, with
+; interrupts disabled and the firmware page tables still loaded. Until CR3 is
+; switched only the pages of the new GDT and tables are written, and Pure64
+; stops if the firmware tables are in them. The rest of the memory the BIOS
+; path clears is cleared after the switch.
+start64_uefi:
+	mov esp, 0x8000			; Set a known free location for the stack
+	cld
+
+	mov rax, cr3			; The firmware PML4
+	and rax, -4096
+	mov ecx, 4096
+	call start64_uefi_check
+	mov rax, [rax]			; The firmware PDP for the first 512GiB
+	and rax, -4096
+	shl rax, 12			; Clear bit 63 (XD) and any bits above the address
+	shr rax, 12
+	call start64_uefi_check
+	sub rsp, 16
+	sgdt [rsp]			; The firmware GDT
+	movzx ecx, word [rsp]
+	inc ecx
+	mov rax, [rsp+2]
+	call start64_uefi_check
+	sidt [rsp]			; The firmware IDT
+	movzx ecx, word [rsp]
+	inc ecx
+	mov rax, [rsp+2]
+	call start64_uefi_check
+	add rsp, 16
+
+	mov edi, 0x5000			; Clear the info map and system variable memory
+	xor eax, eax
+	mov ecx, 960			; 3840 bytes (Range is 0x5000 - 0x5EFF)
+	rep stosd			; Don't overwrite the VBE data at 0x5F00
+
+	rdtsc				; Start of Pure64, and of the paging build
+	mov [IM_TIMING+TIMING_START], eax
+	mov [IM_TIMING+TIMING_START+4], edx
+	mov [IM_TIMING+TIMING_PAGING], eax
+	mov [IM_TIMING+TIMING_PAGING+4], edx
+
+	mov edi, 0x00001000		; Clear 0x1000 - 0x4FFF for the GDT, PML4, and PDPs
+	xor eax, eax
+	mov ecx, 4096
+	rep stosd
+
+	mov esi, gdt64			; Copy the GDT to its final location in memory
+	mov edi, 0x00001000
+	mov ecx, (gdt64_end - gdt64)
+	rep movsb
+
+	mov qword [0x00002000], 0x00003007	; PML4 entry for the low PDP
+	mov qword [0x00002800], 0x00004007	; PML4 entry for the high PDP (0xFFFF800000000000)
+
+	mov edi, 0x00003000		; 4 PDPTEs to map the first 4GiB of RAM
+	mov eax, 0x00010007
+	mov ecx, 4
+start64_uefi_pdpte:
+	stosq
+	add eax, 0x00001000
+	dec ecx
+	jnz start64_uefi_pdpte
+
+	mov edi, 0x00010000		; 2048 PDEs of 2MiB, with P, R/W, U/S, PS, and G set
+	mov eax, 0x00000187		; These fill 0x10000 - 0x13FFF
+	mov ecx, 2048
+start64_uefi_pde:
+	stosq
+	add rax, 0x00200000
+	dec ecx
+	jnz start64_uefi_pde
+
+	lgdt [GDTR64]
+
+	mov rax, cr4
+	or eax, 0x0000000B0		; PGE (Bit 7), PAE (Bit 5), and PSE (Bit 4)
+	mov cr4, rax
+
+	mov ecx, 0xC0000080		; EFER MSR number
+	rdmsr				; Long mode is already active
+	or eax, 0x00000001		; SYSCALL/SYSRET (Bit 0)
+	wrmsr
+
+	mov eax, 0x00002000		; Point cr3 at PML4. Low memory is identity mapped in both
+	mov cr3, rax
+
+	xor edi, edi			; Clear 0x0 - 0xFFF for the IDT
+	xor eax, eax
+	mov ecx, 1024
+	rep stosd
+	mov edi, 0x00014000		; Clear 0x14000 - 0x5FFFF, the rest of the PDE area
+	mov ecx, 77824
+	rep stosd
+
+	push SYS64_CODE_SEL		; Load CS from the new GDT
+	mov rax, start64
+	push rax
+	retfq
+
+; Halt if RAX to RAX+RCX meets the memory written before CR3 is switched
+start64_uefi_check:
+	lea rdx, [rax+rcx]
+	cmp rax, 0x6000
+	jae start64_uefi_check_pd
+	cmp rdx, 0x1000
+	ja start64_uefi_halt		; GDT, PML4, PDPs, and the info map
+start64_uefi_check_pd:
+	cmp rax, 0x14000
+	jae start64_uefi_check_done
+	cmp rdx, 0x10000
+	ja start64_uefi_halt		; Low PDs
+start64_uefi_check_done:
+	ret
+start64_uefi_halt:
+	hlt
+	jmp start64_uefi_halt
+
+
+align 16
+
 start64:
 	xor eax, eax			; aka r0
 	xor ebx, ebx			; aka r3
@@ -257,6 +389,9 @@ start64:
 	jmp rax				; jmp SYS64_CODE_SEL:start64 would have sent us ...
 	nop				; out of compatibility mode and into 64-bit mode
 clearcs64:
+	rdtsc				; End of the paging build
+	mov [IM_TIMING+TIMING_PAGING+8], eax
+	mov [IM_TIMING+TIMING_PAGING+12], edx
 	xor eax, eax
 
 	lgdt [GDTR64]			; Reload the GDT
@@ -265,108 +400,137 @@ clearcs64:
 	mov al, [0x8005]
 	mov [p_BootMode], al		; Save the byte as a Boot Mode flag
 
+%ifndef NO_SMP
 ; Patch Pure64 AP code			; The AP's will be told to start execution at 0x8000
 	mov edi, start			; We need to remove the BSP Jump call to get the AP's
 	mov eax, 0x90909090		; to fall through to the AP Init code
 	stosd
-	stosd				; Write 8 bytes in total to overwrite the 'far jump' and marker
+	stosd
+	stosd
+	stosd				; Write 16 bytes in total to overwrite both entry jumps and the marker
+%endif
 
-	mov al, [p_BootMode]
-	cmp al, 'U'
-	je uefi_memmap
-; Process the E820 memory map to find all possible 2MiB pages that are free to use
-; Build a map at 0x400000
-	xor ecx, ecx
-	xor ebx, ebx			; Counter for pages found
-	mov esi, 0x00006000		; E820 Map location
-nextentry:
-	add esi, 16			; Skip ESI to type marker
-	mov eax, [esi]			; Load the 32-bit type marker
-	cmp eax, 0			; End of the list?
-	je end820
-	cmp eax, 1			; Is it marked as free?
-	je processfree
-	add esi, 16			; Skip ESI to start of next entry
-	jmp nextentry
-
-processfree:
-	sub esi, 16
-	mov rax, [rsi]			; Physical start address
-	add esi, 8
-	mov rcx, [rsi]			; Physical length
-	add esi, 24
-	shr rcx, 21			; Convert bytes to # of 2 MiB pages
-	cmp rcx, 0			; Do we have at least 1 page?
-	je nextentry
-	shl rax, 1
-	mov edx, 0x1FFFFF
-	not rdx				; Clear bits 20 - 0
-	and rax, rdx
-	; At this point RAX points to the start and RCX has the # of pages
-	shr rax, 21			; page # to start on
-	mov rdi, 0x400000		; 4 MiB into physical memory
-	add rdi, rax
+%ifndef NO_LEGACY_IRQ
+; Set up RTC
+; Port 0x70 is RTC Address, and 0x71 is RTC Data
+; http://www.nondot.org/sabre/os/files/MiscHW/RealtimeClockFAQ.txt
+rtc_poll:
+	mov al, 0x0A			; Status Register A
+	out 0x70, al			; Select the address
+	in al, 0x71			; Read the data
+	test al, 0x80			; Is there an update in process?
+	jne rtc_poll			; If so then keep polling
+	mov al, 0x0A			; Status Register A
+	out 0x70, al			; Select the address
+	mov al, 00100110b		; UIP (0), RTC@32.768KHz (010), Rate@1024Hz (0110)
+	out 0x71, al			; Write the data
+%endif
+
+; Remap PIC IRQ's
+; This is kept with NO_LEGACY_IRQ so a stray IRQ can never land on an exception vector
+	mov al, 00010001b		; begin PIC 1 initialization
+	out 0x20, al
+	mov al, 00010001b		; begin PIC 2 initialization
+	out 0xA0, al
+	mov al, 0x20			; IRQ 0-7: interrupts 20h-27h
+	out 0x21, al
+	mov al, 0x28			; IRQ 8-15: interrupts 28h-2Fh
+	out 0xA1, al
+	mov al, 4
+	out 0x21, al
+	mov al, 2
+	out 0xA1, al
 	mov al, 1
-	add ebx, ecx
-	rep stosb
-	jmp nextentry
+	out 0x21, al
+	out 0xA1, al
 
-end820:
-	shl ebx, 1
-	mov dword [p_mem_amount], ebx
-	shr ebx, 1
-	jmp memmap_end
+; Mask all PIC interrupts
+	mov al, 0xFF
+	out 0x21, al
+	out 0xA1, al
 
-uefi_memmap:				; TODO fix this as it is a terrible hack
-	mov rdi, 0x400000
-	mov al, 1
-	mov rcx, 32
-	rep stosb
-	mov ebx, 64
-	mov dword [p_mem_amount], ebx
-memmap_end:
-
-; Create the high memory map
-	mov rcx, rbx
-	shr rcx, 9			; TODO - This isn't the exact math but good enough
-	add rcx, 1			; number of PDPE's to make.. each PDPE maps 1GB of physical memory
-	mov edi, 0x00004000		; location of high PDPE
-	mov eax, 0x00020007		; location of first high PD. Bits (0) P, 1 (R/W), and 2 (U/S) set
-create_pdpe_high:
-	stosq
-	add rax, 0x00001000		; 4K later (512 records x 8 bytes)
-	dec ecx
-	cmp ecx, 0
-	jne create_pdpe_high
+%ifndef NO_SERIAL
+; Configure serial port @ 0x03F8
+	mov dx, 0x03F8 + 1		; Interrupt Enable
+	mov al, 0x00			; Disable all interrupts
+	out dx, al
+	mov dx, 0x03F8 + 3		; Line Control
+	mov al, 80
+	out dx, al
+	mov dx, 0x03F8 + 0		; Divisor Latch
+	mov ax, 1			; 1 = 115200 baud
+	out dx, ax
+	mov dx, 0x03F8 + 3		; Line Control
+	mov al, 3			; 8 bits, no parity, one stop bit
+	out dx, al
+	mov dx, 0x03F8 + 4		; Modem Control
+	mov al, 3
+	out dx, al
+	mov al, 0xC7			; Enable FIFO, clear them, with 14-byte threshold
+	mov dx, 0x03F8 + 2
+	out dx, al
+%endif
 
-; Create the high PD entries
-; EBX contains the number of pages that should exist in the map, once they are all found bail out
-	xor ecx, ecx
-	xor eax, eax
-	xor edx, edx
-	mov edi, 0x00020000		; Location of high PD entries
-	mov esi, 0x00400000		; Location of free pages map
-
-pd_high:
-	cmp rdx, rbx			; Compare mapped pages to max pages
-	je pd_high_done
-	lodsb
-	cmp al, 1
-	je pd_high_entry
-	add rcx, 1
-	jmp pd_high
-
-pd_high_entry:
-	mov eax, 0x0000008F		; Bits 0 (P), 1 (R/W), 2 (U/S), 3 (PWT), and 7 (PS) set
-	shl rcx, 21
-	add rax, rcx
-	shr rcx, 21
-	stosq
-	add rcx, 1
-	add rdx, 1			; We have mapped a valid page
-	jmp pd_high
+	mov al, [p_BootMode]
+	cmp al, 'U'
+	jne memmap_e820
+
+; Convert the UEFI memory map into the E820 format used by the BIOS loaders
+; The UEFI loader stores the size of the map at 0x6000, the size of each
+; descriptor at 0x6008, and the descriptors from 0x6010. The 32-byte E820
+; entries are written from 0x6000 and adjacent entries of the same type merged
+	mov esi, 0x00006010
+	mov edi, 0x00006000
+	mov rcx, [rdi]			; Size of the UEFI memory map
+	mov rbx, [rdi+8]		; Size of each descriptor
+	add rcx, rsi			; RCX is the end of the UEFI memory map
+uefi_memmap:
+	cmp rsi, rcx
+	jae uefi_memmap_end
+	mov eax, [rsi]			; Type
+	mov r8, [rsi+8]			; PhysicalStart
+	mov r9, [rsi+24]		; NumberOfPages
+	add rsi, rbx
+	shl r9, 12			; Convert 4KiB pages to bytes
+	jz uefi_memmap			; Skip any 0 length entries
+	mov edx, 2			; Reserved
+	cmp eax, EFI_MEMORY_TYPES
+	jae uefi_memmap_type
+	movzx edx, byte [uefi_e820_type+rax]
+uefi_memmap_type:
+	cmp edi, 0x00006000
+	je uefi_memmap_new
+	cmp edx, [rdi-32+16]		; Same type as the previous entry?
+	jne uefi_memmap_new
+	mov rax, [rdi-32]
+	add rax, [rdi-32+8]
+	cmp rax, r8			; Does it end where this one starts?
+	jne uefi_memmap_new
+	add [rdi-32+8], r9		; Merge them
+	jmp uefi_memmap
+uefi_memmap_new:
+	mov [rdi], r8
+	mov [rdi+8], r9
+	mov [rdi+16], edx
+	mov dword [rdi+20], 1		; ACPI 3.X attributes, entry is valid
+	mov qword [rdi+24], 0
+	add edi, 32
+	jmp uefi_memmap
+uefi_memmap_end:
+	xor eax, eax			; Create a blank record for termination (32 bytes)
+	mov ecx, 8
+	rep stosd
 
-pd_high_done:
+memmap_e820:
+; Build the sorted list of free memory extents from the E820 memory map
+	call mem_extents
+	mov ecx, TIMING_PAYLOAD
+	call timing_stamp
+	call payload_unpack		; Decompress and check the payload
+	call payload_elf		; Copy the segments of an ELF64 payload to their addresses
+	call payload_reserve		; Remove the payload from the free memory extents
+	mov ecx, TIMING_PAYLOAD+8
+	call timing_stamp
 
 ; Build a temporary IDT
 	xor edi, edi 			; create the 64-bit IDT (at linear address 0x0000000000000000)
@@ -432,6 +596,7 @@ make_interrupt_gates: 			; make gates for the other interrupts
 	mov word [0x12*16], exception_gate_18
 	mov word [0x13*16], exception_gate_19
 
+%ifndef NO_LEGACY_IRQ
 	mov edi, 0x21			; Set up Keyboard handler
 	mov eax, keyboard
 	call create_gate
@@ -441,19 +606,10 @@ make_interrupt_gates: 			; make gates for the other interrupts
 	mov edi, 0x28			; Set up RTC handler
 	mov eax, rtc
 	call create_gate
+%endif
 
 	lidt [IDTR64]			; load IDT register
 
-; Clear memory 0xf000 - 0xf7ff for the InfoMap (2048 bytes)
-	xor eax, eax
-	mov ecx, 256
-	mov edi, 0x0000F000
-clearmapnext:
-	stosq
-	dec ecx
-	cmp ecx, 0
-	jne clearmapnext
-
 ; Read APIC Address from MSR
 	mov ecx, 0x0000001B		; APIC_BASE
 	rdmsr				; Returns APIC in EDX:EAX
@@ -462,29 +618,119 @@ clearmapnext:
 	add rax, rdx
 	mov [p_LocalAPICAddress], rax
 
-; Check for x2APIC support
-	mov eax, 1
-	cpuid				; x2APIC is supported if bit 21 is set
-	shr ecx, 21
-	and cl, 1
-	mov byte [p_x2APIC], cl
+	mov byte [p_NMI_LINT], 1	; NMI is on LINT1 unless the MADT says otherwise
 
+	mov ecx, TIMING_ACPI
+	call timing_stamp
 	call init_acpi			; Find and process the ACPI tables
+	mov ecx, TIMING_ACPI+8
+	call timing_stamp
 
-	call init_cpu			; Configure the BSP CPU
+	call init_numa			; Find the proximity domain of each CPU and free memory extent
 
+	call init_percpu		; Take the stack and data block of each CPU from free memory
+%ifndef NO_PCI
+	call init_pci			; Take the memory for the PCI device table
+%endif
+
+; Extend the identity map and create the high memory map
+	call mem_map			; EBX holds the number of 2MiB pages in the high map
+	shl ebx, 1
+	mov dword [p_mem_amount], ebx
+	call payload_map		; Map the higher half segments of an ELF64 payload
+
+%ifndef NO_X2APIC
+; Enable x2APIC mode if the firmware already did, if an APIC ID requires it, or if requested
+	mov r8b, [p_x2APIC]		; Set by init_acpi if an APIC ID does not fit in 8 bits
+	or r8b, [cfg_x2apic]
+	mov byte [p_x2APIC], 0
+	mov eax, 1
+	cpuid				; x2APIC is supported if bit 21 is set
+	bt ecx, 21
+	jnc x2apic_done
+	mov ecx, 0x0000001B		; APIC_BASE
+	rdmsr
+	bt eax, 10			; Bit 10 is set if x2APIC mode is already enabled
+	jc x2apic_enable
+	cmp r8b, 0
+	je x2apic_done
+x2apic_enable:
+	bts eax, 11			; APIC Global Enable (Bit 11) must be set before EXTD
+	wrmsr
+	bts eax, 10			; x2APIC Enable (Bit 10)
+	wrmsr
+	mov byte [p_x2APIC], 1
+x2apic_done:
+%else
+; Go back to xAPIC mode if the firmware enabled x2APIC. It can only be left by
+; disabling the APIC. Cores with an APIC ID that needs x2APIC are not started
+	mov byte [p_x2APIC], 0
+	mov ecx, 0x0000001B		; APIC_BASE
+	rdmsr
+	btr eax, 10			; x2APIC Enable (Bit 10)
+	jnc x2apic_done
+	btr eax, 11			; APIC Global Enable (Bit 11)
+	wrmsr
+	bts eax, 11
+	wrmsr
+x2apic_done:
+%endif
+
+	call init_mem			; Set the MTRRs and the memory types for the MMIO ranges
+
+	call cpu_prepare		; Choose the CR4 features and XSAVE state components for every core
+
+	mov ecx, TIMING_CPU
+	call timing_stamp
+	call init_cpu			; Configure the BSP CPU
+	mov ecx, TIMING_CPU+8
+	call timing_stamp
+
+%ifndef NO_LEGACY_IRQ
+	cmp byte [cfg_rtc], 1		; The loader itself times delays with the HPET or TSC
+	jne skip_pic
+	mov ecx, TIMING_PIC
+	call timing_stamp
 	call init_pic			; Configure the PIC(s), also activate interrupts
+	mov ecx, TIMING_PIC+8
+	call timing_stamp
+skip_pic:
+%endif
+
+	call init_timer			; Start the HPET and find the TSC frequency
 
+	mov ecx, TIMING_SMP
+	call timing_stamp
 	call init_smp			; Init of SMP
+	mov ecx, TIMING_SMP+8
+	call timing_stamp
 
 ; Reset the stack to the proper location (was set to 0x8000 previously)
-	mov rsi, [p_LocalAPICAddress]	; We would call p_smp_get_id here but the stack is not ...
-	add rsi, 0x20			; ... yet defined. It is safer to find the value directly.
-	lodsd				; Load a 32-bit value. We only want the high 8 bits
-	shr rax, 24			; Shift to the right and AL now holds the CPU's APIC ID
+	call cpu_index			; ECX holds the position of the BSP in the CPU table
+	mov rax, [IM_CPU_AREA+rcx*8]	; The stack ends at the data block
+	cmp rax, 0
+	jne bsp_stack
+	mov eax, ecx
 	shl rax, 10			; shift left 10 bits for a 1024byte stack
 	add rax, 0x0000000000050400	; stacks decrement when you "push", start at 1024 bytes in
-	mov rsp, rax			; Pure64 leaves 0x50000-0x9FFFF free so we use that
+bsp_stack:
+	mov rsp, rax
+	call percpu_setup		; Clear the data block and set GS base
+
+%ifndef NO_SMP
+	call tsc_sync			; Line up the TSCs of the APs with the BSP
+%endif
+
+%ifndef NO_PCI
+	call pci_scan			; Enumerate PCIe with every core if cfg_pci is set
+%endif
+
+%ifndef NO_SCRUB
+	cmp byte [cfg_scrub], 1
+	jne skip_scrub
+	call mem_scrub			; Zero all free memory
+skip_scrub:
+%endif
 
 ; Build the InfoMap
 	xor edi, edi
@@ -501,24 +747,69 @@ clearmapnext:
 	stosw
 	mov ax, [p_cpu_detected]
 	stosw
+	mov al, [p_TSCInvariant]
+	stosb
+	mov al, [p_TSCSource]
+	stosb
+	mov rax, [p_TSCFrequency]
+	stosq
 
 	mov di, 0x5020
-	mov ax, [p_mem_amount]
+	mov eax, [p_mem_amount]
 	stosd
+	mov al, [p_MTRRMode]
+	stosb
+	mov al, [p_TSCSync]
+	stosb
+	mov di, 0x5026
+	mov ax, [p_MemExtents]
+	stosw
+	mov di, 0x5028
+	mov ecx, 0x00000277		; IA32_PAT
+	rdmsr
+	stosd				; PA3-PA0
+	mov eax, edx
+	stosd				; PA7-PA4
 
 	mov di, 0x5030
 	mov al, [p_IOAPICCount]
 	stosb
 	mov al, [p_IOAPICIntSourceC]
 	stosb
+	mov ax, [p_NUMAMem]
+	stosw
+	mov ax, [p_NUMALocalities]
+	stosw
+	mov di, 0x5038
+	mov eax, [p_PayloadSize]
+	stosd
+	mov eax, [p_PayloadChecksum]
+	stosd
 
 	mov di, 0x5040
 	mov rax, [p_HPETAddress]
 	stosq
+	mov eax, [p_CPUStackSize]
+	stosd
+	mov eax, [p_CPUDataSize]
+	stosd
+	mov rax, [p_XCR0]
+	stosq
+	mov eax, [p_XSAVESize]
+	stosd
 
 	mov di, 0x5060
 	mov rax, [p_LocalAPICAddress]
 	stosq
+	mov al, [p_x2APIC]
+	stosb
+	mov di, 0x506C
+	mov eax, [p_CR4Features]
+	stosd
+	mov eax, [p_ScrubRate]
+	stosd
+	mov eax, [p_ScrubTime]
+	stosd
 
 	mov di, 0x5080
 	mov eax, [VBEModeInfoBlock.PhysBasePtr]		; Base address of video memory (if graphics mode is set)
@@ -531,13 +822,47 @@ clearmapnext:
 	mov di, 0x5090
 	mov ax, [p_PCIECount]
 	stosw
+	mov ax, [p_ACPITables]
+	stosw
+	mov eax, [p_PCICount]
+	stosd
+	mov rax, [p_PCITable]
+	stosq
+
+	mov di, 0x50A0
+	mov al, [p_PowerPolicy]
+	stosb
+	mov al, [p_MWAITHint]
+	stosb
+	mov al, [p_EnergyPref]
+	stosb
+	mov di, 0x50A4
+	mov eax, [p_HWPRequest]
+	stosd
 
 ; Move the trailing binary to its final location
+	mov eax, 0x00100000		; Entry point at the 1MiB mark
+	cmp dword [PAYLOAD_HEADER], PAYLOAD_MAGIC
+	jne payload_legacy
+	mov eax, [PAYLOAD_HEADER+PAYLOAD_ENTRY]	; The payload is already at its load address
+	test byte [PAYLOAD_HEADER+PAYLOAD_FLAGS], PAYLOAD_ELF
+	jz payload_ready
+	mov rax, [p_PayloadEntry]	; e_entry of the ELF64 payload
+	jmp payload_ready
+payload_legacy:
 	mov esi, 0x8000+PURE64SIZE	; Memory offset to end of pure64.sys
 	mov edi, 0x100000		; Destination address at the 1MiB mark
 	mov ecx, ((32768 - PURE64SIZE) / 8)
 	rep movsq			; Copy 8 bytes at a time
-
+payload_ready:
+	push rax			; Save the entry point of the payload
+	mov ecx, TIMING_JUMP
+	call timing_stamp
+%ifdef BOOT_TIMING
+	call timing_dump		; Send the time of each stage to the serial port
+%endif
+
+%ifndef NO_SERIAL
 ; Output message via serial port
 	cld				; Clear the direction flag.. we want to increment through the string
 	mov dx, 0x03F8			; Address of first serial port
@@ -556,6 +881,7 @@ serial_nextchar:
 	out dx, al			; Send the char to the serial port
 	jmp serial_nextchar
 serial_done:
+%endif
 
 ; Clear all registers (skip the stack pointer)
 	xor eax, eax			; These 32-bit calls also clear the upper bits of the 64-bit registers
@@ -573,20 +899,30 @@ serial_done:
 	xor r13, r13
 	xor r14, r14
 	xor r15, r15
-	jmp 0x00100000
+	ret				; Jump to the entry point of the payload
 
 
 %include "init/acpi.asm"
 %include "init/cpu.asm"
+%include "init/mem.asm"
+%include "init/numa.asm"
+%include "init/percpu.asm"
+%include "init/payload.asm"
+%ifndef NO_PCI
+%include "init/pci.asm"
+%endif
+%ifndef NO_LEGACY_IRQ
 %include "init/pic.asm"
+%endif
 %include "init/smp.asm"
+%include "init/timer.asm"
+%include "init/video.asm"
 %include "interrupt.asm"
 %include "sysvar.asm"
 
 EOF:
 	db 0xDE, 0xAD, 0xC0, 0xDE
 
-; Pad to an even KB file
 times PURE64SIZE-($-$$) db 0x90
 
 
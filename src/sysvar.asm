@@ -6,10 +6,63 @@
 ; =============================================================================
 
 
+%ifndef NO_SERIAL
 message: db 10, 'Pure64 OK', 10
+msg_payload_fail: db 10, 'Payload read failed', 0
+msg_payload_bad: db 10, 'Payload is corrupt', 0
+%endif
+%ifdef BOOT_TIMING
+timing_stages:				; Start and end entries in IM_TIMING, and the name
+db TIMING_E820, TIMING_READ, 'E820    '
+db TIMING_READ, TIMING_START, 'Read    '
+db TIMING_LOAD, TIMING_LOAD+8, 'Load    '
+db TIMING_VBE, TIMING_PAGING, 'VBE     '
+db TIMING_PAGING, TIMING_PAGING+8, 'Paging  '
+db TIMING_PAYLOAD, TIMING_PAYLOAD+8, 'Payload '
+db TIMING_ACPI, TIMING_ACPI+8, 'ACPI    '
+db TIMING_CPU, TIMING_CPU+8, 'CPU     '
+db TIMING_PIC, TIMING_PIC+8, 'PIC     '
+db TIMING_SMP, TIMING_SMP+8, 'SMP     '
+db TIMING_START, TIMING_JUMP, 'Pure64  '
+db TIMING_E820, TIMING_JUMP, 'Total   '
+db 0xFF
+timing_name_ap: db 'Last AP '
+timing_unit_us: db ' us', 0
+timing_unit_ticks: db ' ticks', 0
+%endif
 
 ;CONFIG
+%ifndef NO_SMP
 cfg_smpinit:		db 1		; By default SMP is enabled. Set to 0 to disable.
+cfg_smpbcast:		db 0		; Set to 1 to start all AP's at once with a broadcast INIT-SIPI-SIPI.
+%endif
+%ifndef NO_X2APIC
+cfg_x2apic:		db 0		; Set to 1 to always use x2APIC mode if supported. It is used automatically if required.
+%endif
+%ifndef NO_LEGACY_IRQ
+cfg_rtc:		db 1		; Set to 0 to only start the PIC and RTC interrupt if they are needed to find the TSC frequency.
+%endif
+cfg_mtrr:		db 0		; Set to 1 to build the MTRRs from the memory map instead of copying the BSP firmware values.
+cfg_cpustack:		db 4		; Stack size of each CPU in 4KiB pages. Set to 0 to use 1KiB stacks below 640KiB.
+cfg_cpudata:		db 1		; Size of the data block of each CPU in 4KiB pages, at least 1.
+%ifndef NO_SCRUB
+cfg_scrub:		db 0		; Set to 1 to zero all free memory with every core before starting the payload.
+%endif
+%ifndef NO_PCI
+cfg_pci:		db 0		; Set to 1 to enumerate PCIe with every core and build a device table for the payload.
+%endif
+cfg_cr4:		db 1		; Set to 0 to leave PGE, PCIDE, and FSGSBASE disabled in CR4.
+cfg_amx:		db 1		; Set to 0 to leave the AMX tile state out of XCR0. It adds about 8KiB to the XSAVE area.
+cfg_power:		db 0		; Set to 1 to apply the HWP, turbo, and C-state settings below on every core.
+cfg_epp:		db 0		; Energy-performance preference. 0 favours performance, 0x80 is balanced, 0xFF favours energy.
+cfg_turbo:		db 1		; Set to 0 to disable turbo.
+cfg_cstate:		db 1		; Deepest MWAIT C-state for the waiting AP's, 1 is C1. Set to 0 to leave them on HLT.
+%ifndef NO_VIDEO
+cfg_video:		db 1		; Set to 0 to boot headless without setting a VBE mode. Only used when booted via the MBR or PXE.
+cfg_video_depth:	db 32		; Bits per pixel of the VBE mode.
+cfg_video_x:		dw 800		; Preferred resolution. The largest listed mode that fits is used, or the smallest if none do.
+cfg_video_y:		dw 600
+%endif
 
 ; Memory locations
 E820Map:		equ 0x0000000000004000
@@ -19,6 +72,56 @@ IM_IOAPICAddress:	equ 0x0000000000005600		; 16 bytes per entry
 IM_IOAPICIntSource:	equ 0x0000000000005700		; 8 bytes per entry
 SystemVariables:	equ 0x0000000000005800
 VBEModeInfoBlock:	equ 0x0000000000005F00		; 256 bytes
+LOADER_RSDP:		equ 0x0000000000005FC0		; 64 bytes, copy of the RSDP from the Multiboot2 loader, in the unused end of the VBE block
+IM_CPU_APICID:		equ 0x0000000000014000		; 4 bytes per entry
+IM_CPU_STATUS:		equ 0x0000000000015000		; 1 byte per entry
+IM_CPU_MAX:		equ 1024			; Maximum number of CPU table entries
+IM_MEMEXTENTS:		equ 0x0000000000016000		; 32 bytes per entry
+IM_MEMEXTENTS_MAX:	equ 255				; Maximum number of extents, plus a blank record
+IM_NUMA_CPU:		equ 0x0000000000018000		; 4 bytes per entry, same order as IM_CPU_APICID
+IM_NUMA_MEM:		equ 0x0000000000019000		; 32 bytes per entry
+IM_NUMA_MEM_MAX:	equ 127				; Maximum number of entries, plus a blank record
+IM_NUMA_SLIT:		equ 0x000000000001A000		; 1 byte per pair of localities
+IM_NUMA_SLIT_MAX:	equ 64				; Maximum number of localities
+IM_CPU_AREA:		equ 0x000000000001B000		; 8 bytes per entry, same order as IM_CPU_APICID
+IM_CPU_TOPOLOGY:	equ 0x0000000000048000		; 32 bytes per entry, same order as IM_CPU_APICID
+IM_CPU_ARRIVAL:		equ 0x000000000001D000		; 8 bytes per entry, same order as IM_CPU_APICID
+IM_TIMING:		equ 0x0000000000005200		; 8 bytes per entry, see TIMING_*
+IM_ACPI_TABLES:		equ 0x000000000001F000		; 16 bytes per entry
+IM_ACPI_TABLES_MAX:	equ 255				; Maximum number of tables, plus a blank record
+PAYLOAD_HEADER:		equ 0x0000000000008000 + PURE64SIZE	; 32 bytes, directly after the padded Pure64 binary
+PAYLOAD_BOUNCE:		equ 0x0000000000010000		; Bounce buffer for payload reads via the BIOS
+PAYLOAD_CHUNK:		equ 127				; Sectors per BIOS read
+MBR_DRIVE:		equ 0x0000000000007DCE		; Drive number left in memory by mbr.asm
+MBR_DAP:		equ 0x0000000000007DDC		; Disk address packet left in memory by mbr.asm
+MBR_TIMING:		equ 0x0000000000007BF0		; 2 timestamps pushed by mbr.asm, the last one first
+
+; Payload header
+PAYLOAD_MAGIC:		equ 'PL64'
+PAYLOAD_FLAGS:		equ 0x04			; DD - Bit 0 set if the payload is LZ4 compressed, bit 1 if it is an ELF64 file
+PAYLOAD_LZ4:		equ 1
+PAYLOAD_ELF:		equ 2
+PAYLOAD_SIZE:		equ 0x08			; DD - Size of the payload in bytes, not including the header
+PAYLOAD_ADDRESS:	equ 0x0C			; DD - Load address of the payload
+PAYLOAD_ENTRY:		equ 0x10			; DD - Entry point of the payload
+PAYLOAD_USIZE:		equ 0x14			; DD - Uncompressed size of an LZ4 payload
+PAYLOAD_CHECKSUM:	equ 0x18			; DD - Adler-32 of the uncompressed payload, 0 to skip the check
+PAYLOAD_SOURCE:		equ 0x1C			; DD - Address of the payload data if a loader left it elsewhere, otherwise 0
+PAYLOAD_HEADER_SIZE:	equ 0x20
+
+; Boot timing table, the TSC at the start of each stage and at the end of some. Also defined in bench/timing.asm
+TIMING_E820:		equ 0x00			; DQ - MBR E820 memory map
+TIMING_VBE:		equ 0x08			; DQ - VBE mode search
+TIMING_READ:		equ 0x10			; DQ - MBR read of Pure64
+TIMING_START:		equ 0x18			; DQ - Pure64 started
+TIMING_LOAD:		equ 0x20			; 2 DQ - payload_load, start and end
+TIMING_PAGING:		equ 0x30			; 2 DQ - Page table build and switch to 64-bit mode
+TIMING_ACPI:		equ 0x40			; 2 DQ - init_acpi
+TIMING_CPU:		equ 0x50			; 2 DQ - init_cpu on the BSP
+TIMING_PIC:		equ 0x60			; 2 DQ - init_pic
+TIMING_SMP:		equ 0x70			; 2 DQ - init_smp
+TIMING_PAYLOAD:		equ 0x80			; 2 DQ - Decompression and placement of the payload
+TIMING_JUMP:		equ 0x90			; DQ - Jump to the payload
 
 ; DQ - Starting at offset 0, increments by 0x8
 p_ACPITableAddress:	equ SystemVariables + 0x00
@@ -26,22 +129,83 @@ p_LocalAPICAddress:	equ SystemVariables + 0x10
 p_Counter_Timer:	equ SystemVariables + 0x18
 p_Counter_RTC:		equ SystemVariables + 0x20
 p_HPETAddress:		equ SystemVariables + 0x28
+p_TSCFrequency:		equ SystemVariables + 0x30	; in Hz
+p_SRATAddress:		equ SystemVariables + 0x38
+p_XCR0:			equ SystemVariables + 0x40	; XCR0 value loaded on every core, 0 if XSAVE is not supported
+p_TSCSyncOffset:	equ SystemVariables + 0x48	; Offset of the AP being synchronized
+p_TSCSyncTSC:		equ SystemVariables + 0x50	; TSC of the AP being synchronized
+p_ScrubNext:		equ SystemVariables + 0x58	; Next 2MiB page of the higher half for mem_scrub
+p_ScrubPages:		equ SystemVariables + 0x60	; 2MiB pages for mem_scrub to zero
+p_PayloadEntry:		equ SystemVariables + 0x68	; Entry point of an ELF64 payload
+p_PCITable:		equ SystemVariables + 0x70	; PCI device table, 0 if PCIe was not enumerated
+p_PageTableEnd:		equ SystemVariables + 0x78	; End of the memory mem_map takes page tables from
 
 ; DD - Starting at offset 0x80, increments by 4
 p_BSP:			equ SystemVariables + 0x80
 p_mem_amount:		equ SystemVariables + 0x84	; in MiB
+p_PayloadSize:		equ SystemVariables + 0x88	; Uncompressed size of the payload in bytes
+p_PayloadChecksum:	equ SystemVariables + 0x8C	; Adler-32 of the payload, 0 if not checked
+p_HPETPeriod:		equ SystemVariables + 0x90	; HPET main counter period in femtoseconds, 0 if not running
+p_CPUStackSize:		equ SystemVariables + 0x94	; Stack size of each CPU in bytes, 0 if the low stacks are used
+p_CPUDataSize:		equ SystemVariables + 0x98	; Data block size of each CPU in bytes
+p_XSAVESize:		equ SystemVariables + 0x9C	; Bytes needed by XSAVE for the components in p_XCR0
+p_CR4Features:		equ SystemVariables + 0xA0	; CR4 bits set on every core by cpu_prepare
+p_TSCSyncState:		equ SystemVariables + 0xA4	; Handshake state for tsc_sync
+p_ScrubDone:		equ SystemVariables + 0xA8	; Cores that finished mem_scrub
+p_ScrubRate:		equ SystemVariables + 0xAC	; MiB per second zeroed by all cores
+p_ScrubTime:		equ SystemVariables + 0xB0	; Milliseconds mem_scrub took
+p_EBDAAddress:		equ SystemVariables + 0xB4	; EBDA from the BIOS data area, 0 if not valid
+p_PCICount:		equ SystemVariables + 0xB8	; Entries in the PCI device table
+p_PCINext:		equ SystemVariables + 0xBC	; Next bus for pci_scan
+p_PCIDone:		equ SystemVariables + 0xC0	; Cores that finished pci_scan
+p_HWPRequest:		equ SystemVariables + 0xC4	; IA32_HWP_REQUEST bits 31:0 written on the BSP, 0 if HWP was not set up
 
 ; DW - Starting at offset 0x100, increments by 2
 p_cpu_speed:		equ SystemVariables + 0x100
 p_cpu_activated:	equ SystemVariables + 0x102
 p_cpu_detected:		equ SystemVariables + 0x104
 p_PCIECount:		equ SystemVariables + 0x106
+p_MemExtents:		equ SystemVariables + 0x108
+p_NUMAMem:		equ SystemVariables + 0x10A
+p_NUMALocalities:	equ SystemVariables + 0x10C
+p_ACPITables:		equ SystemVariables + 0x10E	; Entries in IM_ACPI_TABLES
 
 ; DB - Starting at offset 0x180, increments by 1
 p_IOAPICCount:		equ SystemVariables + 0x180
-p_BootMode:		equ SystemVariables + 0x181	; 'U' for UEFI, otherwise BIOS
+p_BootMode:		equ SystemVariables + 0x181	; 'U' for UEFI, 'M' for Multiboot2, 'B' for the MBR, 'P' for PXE, otherwise BIOS
 p_IOAPICIntSourceC:	equ SystemVariables + 0x182
-p_x2APIC:		equ SystemVariables + 0x183
+p_x2APIC:		equ SystemVariables + 0x183	; 1 if x2APIC mode is enabled
+p_NMI_LINT:		equ SystemVariables + 0x184	; The LINT# that NMI is connected to
+p_MTRRMode:		equ SystemVariables + 0x185	; 0 not supported, 1 firmware copy, 2 built from the memory map
+p_TSCInvariant:		equ SystemVariables + 0x186	; 1 if the TSC runs at a constant rate in all states
+p_TSCSource:		equ SystemVariables + 0x187	; 0 not measured, 1 CPUID 0x15, 2 CPUID 0x16, 3 HPET, 4 RTC
+p_TSCSync:		equ SystemVariables + 0x188	; 1 if no AP has a measurable TSC offset from the BSP
+p_PowerPolicy:		equ SystemVariables + 0x189	; POWER_* settings applied by cpu_power on every core
+p_MWAITHint:		equ SystemVariables + 0x18A	; MWAIT hint of the waiting AP's, 0 is C1
+p_EnergyPref:		equ SystemVariables + 0x18B	; Energy-performance preference written, if POWER_EPP or POWER_EPB
+
+; MTRR values loaded by every core - Starting at offset 0x200
+MTRRState:		equ SystemVariables + 0x200	; 0x168 bytes
+
+; E820 type for each EFI memory type. Loader and Boot Services memory is free
+; once Pure64 is running
+uefi_e820_type:
+db 2	; EfiReservedMemoryType
+db 1	; EfiLoaderCode
+db 1	; EfiLoaderData
+db 1	; EfiBootServicesCode
+db 1	; EfiBootServicesData
+db 2	; EfiRuntimeServicesCode
+db 2	; EfiRuntimeServicesData
+db 1	; EfiConventionalMemory
+db 5	; EfiUnusableMemory
+db 3	; EfiACPIReclaimMemory
+db 4	; EfiACPIMemoryNVS
+db 2	; EfiMemoryMappedIO
+db 2	; EfiMemoryMappedIOPortSpace
+db 2	; EfiPalCode
+db 7	; EfiPersistentMemory
+EFI_MEMORY_TYPES equ $-uefi_e820_type
 
 align 16
 GDTR32:					; Global Descriptors Table Register
@@ -55,8 +219,19 @@ dq 0x00CF9A000000FFFF			; 32-bit code descriptor
 					; 55 Granularity 4KiB, 54 Size 32bit, 47 Present, 44 Code/Data, 43 Executable, 41 Readable
 dq 0x00CF92000000FFFF			; 32-bit data descriptor
 					; 55 Granularity 4KiB, 54 Size 32bit, 47 Present, 44 Code/Data, 41 Writeable
+dq 0x00009A000000FFFF			; 16-bit code descriptor
+					; 47 Present, 44 Code/Data, 43 Executable, 41 Readable
+dq 0x000092000000FFFF			; 16-bit data descriptor
+					; 47 Present, 44 Code/Data, 41 Writeable
 gdt32_end:
 
+align 16
+payload_dap:				; Disk address packet for payload reads via the BIOS
+db 0x10, 0x00
+dw PAYLOAD_CHUNK			; Number of sectors
+dw 0x0000, PAYLOAD_BOUNCE >> 4		; Offset and segment of the bounce buffer
+dq 0					; Starting sector
+
 ; -----------------------------------------------------------------------------
 align 16
 GDTR64:					; Global Descriptors Table Register